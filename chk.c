@@ -1,59 +1,131 @@
 #include "chk.h"
 #include "files.h"
+#include "log.h"
 
-u8* chk = NULL;
-u32 chkSize = 0;
-CHK* chkERA  = NULL;
-CHK* chkDIM  = NULL;
-CHK* chkTILE = NULL;
-CHK* chkMTXM = NULL;
-CHK* chkISOM = NULL;
-bool validTILEChunk = false;
-bool validMTXMChunk = false;
-bool validISOMChunk = false;
-u32 tileSize = 0;
-u32 isomSize = 0;
+// loaded map -- one per thread so test workers can each hold a map
+THREAD_LOCAL u8* chk = NULL;
+THREAD_LOCAL u32 chkSize = 0;
+THREAD_LOCAL bool chkMapped = false;  // chk is a copy-on-write view of the file rather than a heap copy
+
+// sections added to the map, written out after the file's own data -- grows to fit, kept between maps
+THREAD_LOCAL u8* chkAdded = NULL;
+THREAD_LOCAL u32 chkAddedSize = 0;
+THREAD_LOCAL u32 chkAddedCapacity = 0;
+
+// sections are referred to by their offset in the CHK as written out (the file, then chkAdded),
+// so nothing needs fixing up when either buffer moves
+#define OFFSET_NONE       0xFFFFFFFF
+#define Section(offset)   ((CHK*)getCHKPointer(offset))
+
+THREAD_LOCAL u32 eraOffset  = OFFSET_NONE;
+THREAD_LOCAL u32 dimOffset  = OFFSET_NONE;
+THREAD_LOCAL u32 tileOffset = OFFSET_NONE;
+THREAD_LOCAL u32 mtxmOffset = OFFSET_NONE;
+THREAD_LOCAL u32 isomOffset = OFFSET_NONE;
+THREAD_LOCAL bool validTILEChunk = false;
+THREAD_LOCAL bool validMTXMChunk = false;
+THREAD_LOCAL bool validISOMChunk = false;
+THREAD_LOCAL u32 tileSize = 0;
+THREAD_LOCAL u32 isomSize = 0;
+
+// sections changed since the map was loaded, for patchMap
+#define DIRTY_MTXM  1
+#define DIRTY_TILE  2
+#define DIRTY_ISOM  4
+THREAD_LOCAL u32 dirtySections = 0;
+
+// every section in file order, plus a hash table of tags --> first and last section with that tag
+typedef struct {
+  u32 name;
+  u32 first;  // CHK_SECTION_NONE = empty slot
+  u32 last;
+  u32 count;
+} CHKTagSlot;
+
+#define MIN_TAG_SLOTS  64  // must be a power of two
+
+THREAD_LOCAL CHKSection* chkSections = NULL;  // grows to fit, kept between maps
+THREAD_LOCAL u32 chkSectionCount = 0;
+THREAD_LOCAL u32 chkSectionCapacity = 0;
+THREAD_LOCAL CHKTagSlot* chkTags = NULL;
+THREAD_LOCAL u32 chkTagSlots = 0;
+THREAD_LOCAL u32 chkTagCount = 0;
 
 void addCHKSection(u32 section, u32 size, void* data);
+bool indexCHKSection(u32 name, u32 offset, u32 size);
+CHKTagSlot* findCHKTag(u32 name);
+bool growCHKTags();
+u32 selectCHKSection(u32 name, u32 minSize, u32 maxSize);
+void releaseCHKData(u8* data, bool mapped);
+bool detachCHK();
+u8* getCHKPointer(u32 offset);
 
-bool loadMap(const char* path){
+bool loadMap(ISOMContext* ctx, const char* path){
   u32 size = 0;
-  u8* chk = (u8*)readFile(path, &size, FILE_MAP_FILE);
+  bool mapped = false;
+  u8* chk = mapFile(path, &size, FILE_MAP_FILE, &mapped);
   
   if(chk == NULL){
+    logFlush();
     dispError("Error opening file.");
     return false;
   }
-  if(parseCHK(chk, size) == false){
+  if(parseCHK(chk, size, mapped) == false){
+    logFlush();
     dispError("Error parsing CHK.");
-    free(chk);
+    unloadCHK();
     return false;
   }
-  if(loadTileset(getMapEra()) == false){
+  if(ctx->ts != NULL && ctx->ts->era != getMapEra()){
+    releaseTileset(ctx->ts);
+    ctx->ts = NULL;
+  }
+  if(ctx->ts == NULL){
+    ctx->ts = acquireTileset(getMapEra());
+  }
+  if(ctx->ts == NULL){
+    logFlush();
     dispError("Error loading tileset.");
     unloadCHK();
     return false;
   }
   
+  logFlush(); // so parsing messages come out ahead of the caller's results
   return true;
 }
 
-bool writeMap(const char* path){
+// with atomic set, the map is written to a temporary file that then replaces path
+bool writeMap(const char* path, bool atomic){
   u32 saveMode;
   u32 ext;
+  bool result;
+  FileFragment fragments[2];
   
   if(chk == NULL) return false;
   
+  // the source file can't be rewritten while it's mapped
+  if(chkMapped && detachCHK() == false) return false;
+  
   ext = strlen(path);
   if(ext >= 4 && (stricmp(path + ext - 4, ".scm") == 0 || stricmp(path + ext - 4, ".scx") == 0 || stricmp(path + ext - 4, ".mpq") == 0)){
-    puts("mpq file");
+    logDebug(LOG_CHK, "mpq file\n");
     saveMode = FILE_MAP_FILE;
   }else{
-    puts("chk file");
+    logDebug(LOG_CHK, "chk file\n");
     saveMode = FILE_DISK;
   }
   
-  if(writeFile(path, chk, chkSize, saveMode) == false){
+  fragments[0].data = chk;
+  fragments[0].size = chkSize;
+  fragments[1].data = chkAdded;
+  fragments[1].size = chkAddedSize;
+  if(atomic){
+    result = replaceFileFragments(path, fragments, (chkAddedSize != 0) ? 2 : 1, saveMode);
+  }else{
+    result = writeFileFragments(path, fragments, (chkAddedSize != 0) ? 2 : 1, saveMode);
+  }
+  if(result == false){
+    logFlush();
     dispError("Error writing map.");
     return false;
   }
@@ -61,96 +133,106 @@ bool writeMap(const char* path){
   return true;
 }
 
+// writes only the ISOM section's data over the .chk file the map was loaded from -- PATCH_NOT_POSSIBLE
+// means nothing was written and the map has to be saved in full, which only works if ISOM is the only
+// thing that changed and it was already in the file at the right size. With atomic set, the file is
+// replaced by a patched copy instead.
+u32 patchMap(const char* path, bool atomic){
+  u32 ext;
+  
+  if(chk == NULL) return PATCH_NOT_POSSIBLE;
+  if(dirtySections == 0) return PATCH_UNCHANGED;
+  if(!validISOMChunk || isomOffset >= chkSize || chkAddedSize != 0 || (dirtySections & ~DIRTY_ISOM) != 0) return PATCH_NOT_POSSIBLE;
+  ext = strlen(path);
+  if(ext < 4 || stricmp(path + ext - 4, ".chk") != 0) return PATCH_NOT_POSSIBLE;
+  
+  // the source file can't be written while it's mapped
+  if(chkMapped && detachCHK() == false) return PATCH_FAILED;
+  
+  if(patchFile(path, chkSize, isomOffset + 8, Section(isomOffset)->data, isomSize, atomic) == false){
+    logFlush();
+    dispError("Error patching map.");
+    return PATCH_FAILED;
+  }
+  dirtySections = 0;
+  return PATCH_DONE;
+}
+
 
 
-bool parseCHK(u8* data, u32 size){
+// data is kept as the loaded map and released by unloadCHK, even if it can't be parsed --
+// mapped says whether it's a file view
+bool parseCHK(u8* data, u32 size, bool mapped){
   CHK* chunk;
+  CHK* dim;
   u32 position = 0;
   
   unloadCHK();
+  chk = data;
+  chkSize = size;
+  chkMapped = mapped;
   
   while(position + 8 <= size){
     chunk = (CHK*)(&data[position]);
-    switch(chunk->name){
-      case CHK_ERA:
-        if(chunk->size == 2){
-          chkERA = chunk;
-        }
-        break;
-      case CHK_DIM:
-        if(chunk->size == 4){
-          chkDIM = chunk;
-        }
-        break;
-      case CHK_MTXM:
-        if(chunk->size > 0 && chunk->size <= MAX_TILE_SIZE){
-          if(chkMTXM != NULL) puts("WARNING: Duplicate MTXM section is not supported.");
-          chkMTXM = chunk;
-        }
-        break;
-      case CHK_TILE:
-        if(chunk->size > 0 && chunk->size <= MAX_TILE_SIZE){
-          if(chkTILE != NULL) puts("WARNING: Duplicate TILE section is not supported.");
-          chkTILE = chunk;
-        }
-        break;
-      case CHK_ISOM:
-        if(chunk->size > 0 && chunk->size <= MAX_ISOM_SIZE){
-          if(chkISOM != NULL) puts("WARNING: Duplicate ISOM section is not supported.");
-          chkISOM = chunk;
-        }
-        break;
-    }
+    if(chunk->size > size - position - 8) break; // runs past the end of the file
+    if(indexCHKSection(chunk->name, position, chunk->size) == false) return false;
     position += 8 + chunk->size;
   }
   
-  if(chkERA == NULL){
-    puts("ERROR: \"ERA \" section not found.");
+  eraOffset = selectCHKSection(CHK_ERA, 2, 2);
+  dimOffset = selectCHKSection(CHK_DIM, 4, 4);
+  mtxmOffset = selectCHKSection(CHK_MTXM, 1, MAX_TILE_SIZE);
+  tileOffset = selectCHKSection(CHK_TILE, 1, MAX_TILE_SIZE);
+  isomOffset = selectCHKSection(CHK_ISOM, 1, MAX_ISOM_SIZE);
+  
+  if(eraOffset == OFFSET_NONE){
+    logError(LOG_CHK, "ERROR: \"ERA \" section not found.\n");
     return false;
   }
-  if(chkDIM == NULL){
-    puts("ERROR: \"DIM \" section not found.");
+  if(dimOffset == OFFSET_NONE){
+    logError(LOG_CHK, "ERROR: \"DIM \" section not found.\n");
     return false;
   }
-  if(chkDIM->dim.width == 0 || chkDIM->dim.height == 0 || chkDIM->dim.width > 256 || chkDIM->dim.height > 256){
-    puts("ERROR: Invalid map dimensions.");
+  dim = Section(dimOffset);
+  if(dim->dim.width == 0 || dim->dim.height == 0 || dim->dim.width > 256 || dim->dim.height > 256){
+    logError(LOG_CHK, "ERROR: Invalid map dimensions.\n");
     return false;
   }
   
-  printf("dim: %d x %d\nera: %d\n", chkDIM->dim.width, chkDIM->dim.height, chkERA->era);
+  logDebug(LOG_CHK, "dim: %d x %d\nera: %d\n", dim->dim.width, dim->dim.height, Section(eraOffset)->era);
   
-  tileSize = chkDIM->dim.width * chkDIM->dim.height * sizeof(u16);
-  if(chkTILE != NULL){
-    if(chkTILE->size != tileSize){
-      printf("WARNING: TILE section size %d, expected %d\n", chkTILE->size, tileSize);
+  tileSize = dim->dim.width * dim->dim.height * sizeof(u16);
+  if(tileOffset != OFFSET_NONE){
+    if(Section(tileOffset)->size != tileSize){
+      logWarn(LOG_CHK, "WARNING: TILE section size %d, expected %d\n", Section(tileOffset)->size, tileSize);
     }else{
-      puts("TILE found");
+      logDebug(LOG_CHK, "TILE found\n");
       validTILEChunk = true;
     }
   }
-  if(chkMTXM != NULL){
-    if(chkMTXM->size != tileSize){
-      printf("ERROR: MTXM section size %d, expected %d\n", chkMTXM->size, tileSize);
+  if(mtxmOffset != OFFSET_NONE){
+    if(Section(mtxmOffset)->size != tileSize){
+      logError(LOG_CHK, "ERROR: MTXM section size %d, expected %d\n", Section(mtxmOffset)->size, tileSize);
     }else{
-      puts("MTXM found");
+      logDebug(LOG_CHK, "MTXM found\n");
       validMTXMChunk = true;
     }
   }
   if(!validTILEChunk && !validMTXMChunk){
-    puts("ERROR: Valid \"TILE\" or \"MTXM\" sections not found.");
+    logError(LOG_CHK, "ERROR: Valid \"TILE\" or \"MTXM\" sections not found.\n");
     return false;
   }
   
-  isomSize = (chkDIM->dim.width/2+1) * (chkDIM->dim.height+1) * sizeof(ISOMRect);
-  if(chkISOM != NULL){
-    if(chkISOM->size != isomSize){
-      printf("WARNING: ISOM section size %d, expected %d\n", chkISOM->size, isomSize);
+  isomSize = (dim->dim.width/2+1) * (dim->dim.height+1) * sizeof(ISOMRect);
+  if(isomOffset != OFFSET_NONE){
+    if(Section(isomOffset)->size != isomSize){
+      logWarn(LOG_CHK, "WARNING: ISOM section size %d, expected %d\n", Section(isomOffset)->size, isomSize);
     }else{
       u32 i;
       // only consider data valid if it is non-null
       validISOMChunk = false;
       for(i = 0; i < isomSize/4; i++){
-        if(chkISOM->data32[i] != 0){
+        if(Section(isomOffset)->data32[i] != 0){
           validISOMChunk = true;
           break;
         }
@@ -158,151 +240,388 @@ bool parseCHK(u8* data, u32 size){
     }
   }
   
-  chk = data;
-  chkSize = size;
-  
   return true;
 }
 
 void unloadCHK(){
-  if(chk != NULL) free(chk);
+  releaseCHKData(chk, chkMapped);
+  chkAddedSize = 0;
+  chkSectionCount = 0;
+  chkTagCount = 0;
+  if(chkTags != NULL) memset(chkTags, 0xFF, chkTagSlots*sizeof(CHKTagSlot));
   chk = NULL;
   chkSize = 0;
-  chkERA = NULL;
-  chkDIM = NULL;
-  chkTILE = NULL;
-  chkMTXM = NULL;
-  chkISOM = NULL;
+  chkMapped = false;
+  eraOffset = OFFSET_NONE;
+  dimOffset = OFFSET_NONE;
+  tileOffset = OFFSET_NONE;
+  mtxmOffset = OFFSET_NONE;
+  isomOffset = OFFSET_NONE;
   validTILEChunk = false;
   validMTXMChunk = false;
   validISOMChunk = false;
   tileSize = 0;
   isomSize = 0;
+  dirtySections = 0;
+}
+
+// unloads the map and frees the buffers kept between maps -- call before a thread that loaded maps exits
+void freeCHKBuffers(){
+  unloadCHK();
+  if(chkAdded != NULL) free(chkAdded);
+  chkAdded = NULL;
+  chkAddedCapacity = 0;
+  if(chkSections != NULL) free(chkSections);
+  chkSections = NULL;
+  chkSectionCapacity = 0;
+  if(chkTags != NULL) free(chkTags);
+  chkTags = NULL;
+  chkTagSlots = 0;
 }
 
+// the loaded file's own buffer -- sections added since are kept separately until the map is saved
 u8* getCHK(u32* size){
   if(size != NULL) *size = chkSize;
   return chk;
 }
 
+// an offset into the CHK as it will be written out, or NULL past its end
+u8* getCHKPointer(u32 offset){
+  if(offset < chkSize) return chk + offset;
+  if(offset - chkSize < chkAddedSize) return chkAdded + (offset - chkSize);
+  return NULL;
+}
+
+// appends a section to the index
+bool indexCHKSection(u32 name, u32 offset, u32 size){
+  CHKSection* sections;
+  CHKTagSlot* tag;
+  u32 capacity;
+  
+  if(chkSectionCount == chkSectionCapacity){
+    capacity = chkSectionCapacity ? chkSectionCapacity*2 : 64;
+    sections = realloc(chkSections, capacity*sizeof(CHKSection));
+    if(sections == NULL){
+      logError(LOG_GENERAL, "Could not allocate memory :(\n");
+      return false;
+    }
+    chkSections = sections;
+    chkSectionCapacity = capacity;
+  }
+  if((chkTagCount+1)*2 > chkTagSlots && growCHKTags() == false) return false;
+  
+  chkSections[chkSectionCount].name = name;
+  chkSections[chkSectionCount].offset = offset;
+  chkSections[chkSectionCount].size = size;
+  chkSections[chkSectionCount].next = CHK_SECTION_NONE;
+  
+  tag = findCHKTag(name);
+  if(tag->first == CHK_SECTION_NONE){
+    tag->name = name;
+    tag->first = chkSectionCount;
+    tag->count = 0;
+    chkTagCount++;
+  }else{
+    chkSections[tag->last].next = chkSectionCount;
+  }
+  tag->last = chkSectionCount;
+  tag->count++;
+  chkSectionCount++;
+  return true;
+}
+
+// the tag's slot, or the empty slot where it belongs -- the table is never more than half full
+CHKTagSlot* findCHKTag(u32 name){
+  u32 i = name * 0x9E3779B1;
+  i = (i ^ (i >> 16)) & (chkTagSlots-1);
+  while(chkTags[i].first != CHK_SECTION_NONE && chkTags[i].name != name){
+    i = (i+1) & (chkTagSlots-1);
+  }
+  return &chkTags[i];
+}
+
+// doubles the tag table, rehashing anything already in it
+bool growCHKTags(){
+  CHKTagSlot* old = chkTags;
+  u32 oldSlots = chkTagSlots;
+  u32 i;
+  
+  chkTagSlots = oldSlots ? oldSlots*2 : MIN_TAG_SLOTS;
+  chkTags = malloc(chkTagSlots*sizeof(CHKTagSlot));
+  if(chkTags == NULL){
+    logError(LOG_GENERAL, "Could not allocate memory :(\n");
+    chkTags = old;
+    chkTagSlots = oldSlots;
+    return false;
+  }
+  memset(chkTags, 0xFF, chkTagSlots*sizeof(CHKTagSlot));
+  for(i = 0; i < oldSlots; i++){
+    if(old[i].first != CHK_SECTION_NONE) *findCHKTag(old[i].name) = old[i];
+  }
+  if(old != NULL) free(old);
+  return true;
+}
+
+// offset of the last section with the tag and an acceptable size -- later sections override earlier ones
+u32 selectCHKSection(u32 name, u32 minSize, u32 maxSize){
+  u32 i;
+  u32 found = CHK_SECTION_NONE;
+  u32 count = 0;
+  
+  for(i = findCHKSection(name); i != CHK_SECTION_NONE; i = chkSections[i].next){
+    if(chkSections[i].size < minSize || chkSections[i].size > maxSize) continue;
+    found = i;
+    count++;
+  }
+  if(found == CHK_SECTION_NONE) return OFFSET_NONE;
+  if(count > 1) logWarn(LOG_CHK, "WARNING: %d \"%.4s\" sections, using the last one\n", count, (char*)&name);
+  return chkSections[found].offset;
+}
+
+// index of the first section with the tag, or CHK_SECTION_NONE -- follow CHKSection.next for the rest
+u32 findCHKSection(u32 name){
+  if(chkTagSlots == 0) return CHK_SECTION_NONE;
+  return findCHKTag(name)->first;
+}
+
+// index of the last section with the tag, which is the one StarCraft uses for most sections
+u32 findLastCHKSection(u32 name){
+  CHKTagSlot* tag;
+  if(chkTagSlots == 0) return CHK_SECTION_NONE;
+  tag = findCHKTag(name);
+  return (tag->first == CHK_SECTION_NONE) ? CHK_SECTION_NONE : tag->last;
+}
+
+u32 countCHKSections(u32 name){
+  CHKTagSlot* tag;
+  if(chkTagSlots == 0) return 0;
+  tag = findCHKTag(name);
+  return (tag->first == CHK_SECTION_NONE) ? 0 : tag->count;
+}
+
+u32 getCHKSectionCount(){
+  return chkSectionCount;
+}
+
+const CHKSection* getCHKSection(u32 index){
+  if(index >= chkSectionCount) return NULL;
+  return &chkSections[index];
+}
+
+// pointer to the section's data, only valid until the CHK is next modified or unloaded
+u8* getCHKSectionData(u32 index, u32* size){
+  if(index >= chkSectionCount || chk == NULL) return NULL;
+  if(size != NULL) *size = chkSections[index].size;
+  return getCHKPointer(chkSections[index].offset) + 8;
+}
+
+
+void releaseCHKData(u8* data, bool mapped){
+  if(data == NULL) return;
+  if(mapped){
+    unmapFile(data);
+  }else{
+    free(data);
+  }
+}
+
+// replaces a mapped chk with a heap copy of itself
+bool detachCHK(){
+  u8* newCHK;
+  
+  if(!chkMapped) return true;
+  newCHK = malloc(chkSize);
+  if(newCHK == NULL){
+    logError(LOG_GENERAL, "Could not allocate memory :(\n");
+    return false;
+  }
+  memcpy(newCHK, chk, chkSize);
+  
+  unmapFile(chk);
+  chk = newCHK;
+  chkMapped = false;
+  return true;
+}
+
 
 void setCHKData(u32 section, void* data){
   switch(section){
     case CHK_MTXM:
+      dirtySections |= DIRTY_MTXM;
       if(validMTXMChunk){
-        memcpy(chkMTXM->data, data, tileSize);
+        memcpy(Section(mtxmOffset)->data, data, tileSize);
       }else{
         addCHKSection(section, tileSize, data);
       }
       break;
     case CHK_TILE:
+      dirtySections |= DIRTY_TILE;
       if(validTILEChunk){
-        memcpy(chkTILE->data, data, tileSize);
+        memcpy(Section(tileOffset)->data, data, tileSize);
       }else{
         addCHKSection(section, tileSize, data);
       }
       break;
     case CHK_ISOM:
-      if(validISOMChunk){
-        memcpy(chkISOM->data, data, isomSize);
+      dirtySections |= DIRTY_ISOM;
+      if(validISOMChunk || (isomOffset != OFFSET_NONE && Section(isomOffset)->size == isomSize)){
+        // an empty or cleared section of the right size is reused rather than duplicated
+        memcpy(Section(isomOffset)->data, data, isomSize);
+        validISOMChunk = true;
       }else{
         addCHKSection(section, isomSize, data);
       }
       break;
     default:
-      puts("Error adding unsupported section");
+      logError(LOG_CHK, "Error adding unsupported section\n");
       return;
   }
 }
 
 
 u32 getMapEra(){
-  if(chkERA == NULL) return 0;
-  return chkERA->era & 7;
+  if(eraOffset == OFFSET_NONE) return 0;
+  return Section(eraOffset)->era & 7;
 }
 
 void getMapDim(u32* width, u32* height){
-  if(chkDIM == NULL) return;
-  if(width  != NULL) *width  = chkDIM->dim.width;
-  if(height != NULL) *height = chkDIM->dim.height;
+  if(dimOffset == OFFSET_NONE) return;
+  if(width  != NULL) *width  = Section(dimOffset)->dim.width;
+  if(height != NULL) *height = Section(dimOffset)->dim.height;
 }
 
 void getMapTILE(u16* buffer){
-  if(chkDIM == NULL || buffer == NULL) return;
+  if(dimOffset == OFFSET_NONE || buffer == NULL) return;
   if(validTILEChunk){
-    memcpy(buffer, chkTILE->data, tileSize);
+    memcpy(buffer, Section(tileOffset)->data, tileSize);
   }else if(validMTXMChunk){
-    memcpy(buffer, chkMTXM->data, tileSize);
+    memcpy(buffer, Section(mtxmOffset)->data, tileSize);
   }else{
     memset(buffer, 0, tileSize);
   }
 }
 
 void getMapMTXM(u16* buffer){
-  if(chkDIM == NULL || buffer == NULL) return;
+  if(dimOffset == OFFSET_NONE || buffer == NULL) return;
   if(validMTXMChunk){
-    memcpy(buffer, chkMTXM->data, tileSize);
+    memcpy(buffer, Section(mtxmOffset)->data, tileSize);
   }else if(validTILEChunk){
-    memcpy(buffer, chkTILE->data, tileSize);
+    memcpy(buffer, Section(tileOffset)->data, tileSize);
   }else{
     memset(buffer, 0, tileSize);
   }
 }
 
+// the map's tiles as stored in the CHK (MTXM, or TILE without one), or NULL if it has neither --
+// like getMapISOMView, only valid until the CHK is next modified or unloaded
+const u16* getMapMTXMView(){
+  if(dimOffset == OFFSET_NONE) return NULL;
+  if(validMTXMChunk) return Section(mtxmOffset)->tiles;
+  if(validTILEChunk) return Section(tileOffset)->tiles;
+  return NULL;
+}
+
 void getMapISOM(ISOMRect* buffer){
-  if(chkDIM == NULL || chkISOM == NULL || buffer == NULL) return;
+  if(dimOffset == OFFSET_NONE || isomOffset == OFFSET_NONE || buffer == NULL) return;
   if(validISOMChunk){
-    memcpy(buffer, chkISOM->data, isomSize);
+    memcpy(buffer, Section(isomOffset)->data, isomSize);
   }else{
     memset(buffer, 0, isomSize);
   }
 }
 
+// the map's ISOM data as stored in the CHK, or NULL if it has none
+const ISOMRect* getMapISOMView(){
+  if(!hasISOMData()) return NULL;
+  return (const ISOMRect*)Section(isomOffset)->data;
+}
+
+// copies rows of a full-map tile buffer into MTXM (and TILE, if the map has one)
+void setMapTileRows(const u16* buffer, u32 firstRow, u32 rowCount){
+  CHK* dim = Section(dimOffset);
+  u32 offset, size;
+  if(dimOffset == OFFSET_NONE || buffer == NULL || firstRow >= dim->dim.height) return;
+  if(firstRow + rowCount > dim->dim.height) rowCount = dim->dim.height - firstRow;
+  if(!validMTXMChunk){
+    setCHKData(CHK_MTXM, (void*)buffer);
+    return;
+  }
+  offset = firstRow * dim->dim.width;
+  size = rowCount * dim->dim.width * sizeof(u16);
+  memcpy(Section(mtxmOffset)->tiles + offset, buffer + offset, size);
+  dirtySections |= DIRTY_MTXM;
+  if(validTILEChunk){
+    memcpy(Section(tileOffset)->tiles + offset, buffer + offset, size);
+    dirtySections |= DIRTY_TILE;
+  }
+}
+
+// copies rows of a full-map ISOM buffer into the ISOM section
+void setMapISOMRows(const ISOMRect* buffer, u32 firstRow, u32 rowCount){
+  CHK* dim = Section(dimOffset);
+  u32 offset, size;
+  if(dimOffset == OFFSET_NONE || buffer == NULL || firstRow > dim->dim.height) return;
+  if(firstRow + rowCount > dim->dim.height+1) rowCount = dim->dim.height+1 - firstRow;
+  if(!validISOMChunk){
+    setCHKData(CHK_ISOM, (void*)buffer);
+    return;
+  }
+  offset = firstRow * (dim->dim.width/2+1);
+  size = rowCount * (dim->dim.width/2+1) * sizeof(ISOMRect);
+  memcpy((ISOMRect*)Section(isomOffset)->data + offset, buffer + offset, size);
+  dirtySections |= DIRTY_ISOM;
+}
+
 void clearMapISOM(){
-  if(chkDIM == NULL || chkISOM == NULL || validISOMChunk == false) return;
-  memset(chkISOM->data, 0, isomSize);
+  if(dimOffset == OFFSET_NONE || isomOffset == OFFSET_NONE || validISOMChunk == false) return;
+  memset(Section(isomOffset)->data, 0, isomSize);
   validISOMChunk = false;
+  dirtySections |= DIRTY_ISOM;
 }
 
 
 bool hasTILEData(){
-  return chkDIM != NULL && chkTILE != NULL && validTILEChunk;
+  return dimOffset != OFFSET_NONE && tileOffset != OFFSET_NONE && validTILEChunk;
 }
 
 bool hasMTXMData(){
-  return chkDIM != NULL && chkMTXM != NULL && validMTXMChunk;
+  return dimOffset != OFFSET_NONE && mtxmOffset != OFFSET_NONE && validMTXMChunk;
 }
 
 bool hasISOMData(){
-  return chkDIM != NULL && chkISOM != NULL && validISOMChunk;
+  return dimOffset != OFFSET_NONE && isomOffset != OFFSET_NONE && validISOMChunk;
 }
 
 u16 getMTXMTile(u32 x, u32 y){
-  if(x >= chkDIM->dim.width || y >= chkDIM->dim.height) return 0;
+  CHK* dim = Section(dimOffset);
+  if(x >= dim->dim.width || y >= dim->dim.height) return 0;
   if(validMTXMChunk){
-    return chkMTXM->tiles[y*chkDIM->dim.width + x];
+    return Section(mtxmOffset)->tiles[y*dim->dim.width + x];
   }else if(validTILEChunk){
-    return chkTILE->tiles[y*chkDIM->dim.width + x];
+    return Section(tileOffset)->tiles[y*dim->dim.width + x];
   }else{
     return 0;
   }
 }
 
 u16 getTILETile(u32 x, u32 y){
-  if(!validTILEChunk || x >= chkDIM->dim.width || y >= chkDIM->dim.height) return 0;
-  return chkTILE->tiles[y*chkDIM->dim.width + x];
+  CHK* dim = Section(dimOffset);
+  if(!validTILEChunk || x >= dim->dim.width || y >= dim->dim.height) return 0;
+  return Section(tileOffset)->tiles[y*dim->dim.width + x];
 }
 
 
+// appends the section to chkAdded, so nothing else in the CHK is copied
 void addCHKSection(u32 section, u32 size, void* data){
-  u8* newCHK = NULL;
-  u32 newSize = chkSize + size + 8;
   CHK* newSect = NULL;
+  u8* added;
+  u32 capacity;
+  u32 offset;
   
   switch(section){
     case CHK_MTXM:
       if(size != tileSize){
-        printf("Error: Invalid MTXM size %d (expected %d)\n", size, tileSize);
+        logError(LOG_CHK, "Error: Invalid MTXM size %d (expected %d)\n", size, tileSize);
         return;
       }
       if(validMTXMChunk){
@@ -312,7 +631,7 @@ void addCHKSection(u32 section, u32 size, void* data){
       break;
     case CHK_TILE:
       if(size != tileSize){
-        printf("Error: Invalid TILE size %d (expected %d)\n", size, tileSize);
+        logError(LOG_CHK, "Error: Invalid TILE size %d (expected %d)\n", size, tileSize);
         return;
       }
       if(validTILEChunk){
@@ -322,7 +641,7 @@ void addCHKSection(u32 section, u32 size, void* data){
       break;
     case CHK_ISOM:
       if(size != isomSize){
-        printf("Error: Invalid ISOM size %d (expected %d)\n", size, isomSize);
+        logError(LOG_CHK, "Error: Invalid ISOM size %d (expected %d)\n", size, isomSize);
         return;
       }
       if(validISOMChunk){
@@ -331,43 +650,41 @@ void addCHKSection(u32 section, u32 size, void* data){
       }
       break;
     default:
-      puts("Error adding unsupported section");
+      logError(LOG_CHK, "Error adding unsupported section\n");
       return;
   }
   
-  newCHK = malloc(newSize);
-  if(newCHK == NULL){
-    puts("Could not allocate memory :(");
-    return;
+  if(chkAddedSize + size + 8 > chkAddedCapacity){
+    capacity = chkAddedCapacity ? chkAddedCapacity*2 : 0x10000;
+    while(capacity < chkAddedSize + size + 8) capacity *= 2;
+    added = realloc(chkAdded, capacity);
+    if(added == NULL){
+      logError(LOG_GENERAL, "Could not allocate memory :(\n");
+      return;
+    }
+    chkAdded = added;
+    chkAddedCapacity = capacity;
   }
   
-  memcpy(newCHK, chk, chkSize);
-  
-  if(chkERA != NULL) chkERA = (CHK*)((u32)chkERA - (u32)chk + (u32)newCHK);
-  if(chkDIM != NULL) chkDIM = (CHK*)((u32)chkDIM - (u32)chk + (u32)newCHK);
-  if(chkTILE != NULL) chkTILE = (CHK*)((u32)chkTILE - (u32)chk + (u32)newCHK);
-  if(chkMTXM != NULL) chkMTXM = (CHK*)((u32)chkMTXM - (u32)chk + (u32)newCHK);
-  if(chkISOM != NULL) chkISOM = (CHK*)((u32)chkISOM - (u32)chk + (u32)newCHK);
-  newSect = (CHK*)((u32)newCHK + chkSize);
-  free(chk);
-  chk = newCHK;
-  chkSize = newSize;
-  
+  offset = chkSize + chkAddedSize;
+  if(indexCHKSection(section, offset, size) == false) return;
+  newSect = (CHK*)(chkAdded + chkAddedSize);
   newSect->name = section;
   newSect->size = size;
   memcpy(newSect->data, data, size);
+  chkAddedSize += size + 8;
   
   switch(section){
     case CHK_MTXM:
-      chkMTXM = newSect;
+      mtxmOffset = offset;
       validMTXMChunk = true;
       break;
     case CHK_TILE:
-      chkTILE = newSect;
+      tileOffset = offset;
       validTILEChunk = true;
       break;
     case CHK_ISOM:
-      chkISOM = newSect;
+      isomOffset = offset;
       validISOMChunk = true;
       break;
   }
@@ -18,19 +18,48 @@ typedef struct {
   };
 } CHK;
 
-bool loadMap(const char* path);
-bool writeMap(const char* path);
+// an entry of the section index, in file order
+typedef struct {
+  u32 name;
+  u32 offset;  // of the section header within the CHK
+  u32 size;
+  u32 next;    // index of the next section with the same name, or CHK_SECTION_NONE
+} CHKSection;
+
+#define CHK_SECTION_NONE  0xFFFFFFFF
+
+// patchMap results
+#define PATCH_DONE          0
+#define PATCH_UNCHANGED     1  // nothing was changed, so nothing was written
+#define PATCH_NOT_POSSIBLE  2  // nothing was written, the map has to be saved in full
+#define PATCH_FAILED        3
+
+bool loadMap(ISOMContext* ctx, const char* path);
+bool writeMap(const char* path, bool atomic);
+u32 patchMap(const char* path, bool atomic);
 
 void unloadCHK();
-bool parseCHK(u8* data, u32 size);
+void freeCHKBuffers();
+bool parseCHK(u8* data, u32 size, bool mapped);
 void setCHKData(u32 section, void* data);
 u8* getCHK(u32* size);
 
+u32 getCHKSectionCount();
+const CHKSection* getCHKSection(u32 index);
+u32 findCHKSection(u32 name);
+u32 findLastCHKSection(u32 name);
+u32 countCHKSections(u32 name);
+u8* getCHKSectionData(u32 index, u32* size);
+
 u32  getMapEra();
 void getMapDim(u32* width, u32* height);
 void getMapTILE(u16* buffer);
 void getMapMTXM(u16* buffer);
 void getMapISOM(ISOMRect* buffer);
+const u16* getMapMTXMView();
+const ISOMRect* getMapISOMView();
+void setMapTileRows(const u16* buffer, u32 firstRow, u32 rowCount);
+void setMapISOMRows(const ISOMRect* buffer, u32 firstRow, u32 rowCount);
 void clearMapISOM();
 bool hasTILEData();
 bool hasMTXMData();
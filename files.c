@@ -1,4 +1,5 @@
 #include "files.h"
+#include "log.h"
 #include "sfmpq_static.h"
 #include "CascLib.h"
 
@@ -7,8 +8,12 @@
 #undef sprintf
 
 u8* readFileDisk(const char* path, u32* filesize);
+u8* mapFileDisk(const char* path, u32* filesize);
 bool readFileFixedDisk(const char* path, void* buffer, u32 filesize);
-bool writeFileDisk(const char* path, u8* data, u32 filesize);
+bool writeFileDisk(const char* path, const FileFragment* fragments, u32 count);
+bool patchFileDisk(const char* path, u32 expectedSize, u32 offset, const u8* data, u32 size);
+bool getTempPath(const char* path, char* tmpPath);
+bool replaceWithTemp(const char* tmpPath, const char* path, bool finished);
 u8* readFileMPQ(const char* path, u32* filesize);
 bool readFileFixedMPQ(const char* path, void* buffer, u32 filesize);
 bool writeFileMPQ(const char* path, const char* mpqPath, u8* data, u32 filesize);
@@ -20,14 +25,19 @@ bool mpqLoaded = false;
 bool cascLoaded = false;
 HANDLE casc = NULL;
 
+// SFmpq and CascLib keep global state, so archive access is serialized between threads
+CRITICAL_SECTION archiveLock;
+
 
 
 
 void initArchiveData(){
+  InitializeCriticalSection(&archiveLock);
+  
   char* path = getInstallPathCASC();
   if(path != NULL){
     if(CascOpenStorage(path, 0, &casc) == true){
-      puts("CASC data located.");
+      logInfo(LOG_FILES, "CASC data located.\n");
       cascLoaded = true;
     }
     free(path);
@@ -52,17 +62,21 @@ void closeArchiveData(){
     // close MPQs
     mpqLoaded = false;
   }
+  DeleteCriticalSection(&archiveLock);
 }
 
 
 u8* readFile(const char* path, u32* filesize, u32 source){
   MPQHANDLE hMPQ = NULL;
   u8* tmp = NULL;
+  bool locked = false;
   
   if(source == FILE_MAP_FILE){
     if(strcmpi(path + strlen(path) - 4, ".chk") == 0){
       source = FILE_DISK;
     }else{
+      EnterCriticalSection(&archiveLock);
+      locked = true;
       if(SFileOpenArchive(path, 120, 0, &hMPQ)){
         path = "staredit\\scenario.chk";
         source = FILE_MPQ;
@@ -79,6 +93,10 @@ u8* readFile(const char* path, u32* filesize, u32 source){
       source = FILE_DISK;
     }
   }
+  if(source != FILE_DISK && !locked){
+    EnterCriticalSection(&archiveLock);
+    locked = true;
+  }
   
   switch(source){
     case FILE_DISK:
@@ -95,11 +113,40 @@ u8* readFile(const char* path, u32* filesize, u32 source){
   if(hMPQ != NULL){
     SFileCloseArchive(hMPQ);
   }
+  if(locked){
+    LeaveCriticalSection(&archiveLock);
+  }
   
   return tmp;
 }
 
+// like readFile, but plain files on disk are mapped instead of read -- *mapped says
+// whether to release the data with unmapFile or free
+u8* mapFile(const char* path, u32* filesize, u32 source, bool* mapped){
+  u8* data;
+  
+  *mapped = false;
+  if(source == FILE_MAP_FILE && strcmpi(path + strlen(path) - 4, ".chk") == 0){
+    source = FILE_DISK;
+  }
+  if(source == FILE_DISK){
+    data = mapFileDisk(path, filesize);
+    if(data != NULL){
+      *mapped = true;
+      return data;
+    }
+  }
+  // couldn't map it -- readFile reports why
+  return readFile(path, filesize, source);
+}
+
+void unmapFile(u8* data){
+  if(data != NULL) UnmapViewOfFile(data);
+}
+
 bool readFileFixed(const char* path, void* buffer, u32 filesize, u32 source){
+  bool result = false;
+  
   if(source == FILE_MAP_FILE){
     return false;
   }else if(source == FILE_ARCHIVE){
@@ -116,35 +163,119 @@ bool readFileFixed(const char* path, void* buffer, u32 filesize, u32 source){
     case FILE_DISK:
       return readFileFixedDisk(path, buffer, filesize);
     case FILE_MPQ:
-      return readFileFixedMPQ(path, buffer, filesize);
+      EnterCriticalSection(&archiveLock);
+      result = readFileFixedMPQ(path, buffer, filesize);
+      LeaveCriticalSection(&archiveLock);
+      break;
     case FILE_CASC:
-      return readFileFixedCASC(path, buffer, filesize);
+      EnterCriticalSection(&archiveLock);
+      result = readFileFixedCASC(path, buffer, filesize);
+      LeaveCriticalSection(&archiveLock);
+      break;
   }
+  return result;
 }
 
 
 bool writeFile(const char* path, u8* data, u32 filesize, u32 destination){
-  u8* tmp = NULL;
+  FileFragment fragment = {data, filesize};
+  return writeFileFragments(path, &fragment, 1, destination);
+}
+
+// raw .chk files are written to disk, anything else is a map archive
+u32 getMapFileDestination(const char* path){
+  if(strcmpi(path + strlen(path) - 4, ".chk") == 0) return FILE_DISK;
+  return FILE_MPQ;
+}
+
+// writes the fragments back to back as a single file
+bool writeFileFragments(const char* path, const FileFragment* fragments, u32 count, u32 destination){
+  u8* data;
+  u32 i, size;
+  bool result;
   
-  if(destination == FILE_MAP_FILE){
-    if(strcmpi(path + strlen(path) - 4, ".chk") == 0){
-      destination = FILE_DISK;
-    }else{
-      destination = FILE_MPQ;
-    }
-  }
+  if(destination == FILE_MAP_FILE) destination = getMapFileDestination(path);
   
   switch(destination){
     case FILE_DISK:
-      return writeFileDisk(path, data, filesize);
+      return writeFileDisk(path, fragments, count);
     case FILE_MPQ:
-      return writeFileMPQ(path, "staredit\\scenario.chk", data, filesize);
+      if(count == 1){
+        return writeFileMPQ(path, "staredit\\scenario.chk", (u8*)fragments[0].data, fragments[0].size);
+      }
+      // SFmpq only adds files from a single buffer
+      size = 0;
+      for(i = 0; i < count; i++){
+        size += fragments[i].size;
+      }
+      data = malloc(size);
+      if(data == NULL){
+        logError(LOG_GENERAL, "ERR: Could not allocate memory\n");
+        return false;
+      }
+      size = 0;
+      for(i = 0; i < count; i++){
+        memcpy(data + size, fragments[i].data, fragments[i].size);
+        size += fragments[i].size;
+      }
+      result = writeFileMPQ(path, "staredit\\scenario.chk", data, size);
+      free(data);
+      return result;
     default:
-      puts("ERROR: Unsupported write mode.");
+      logError(LOG_FILES, "ERROR: Unsupported write mode.\n");
       return false;
   }
 }
 
+// overwrites size bytes at offset in a file on disk and leaves the rest alone -- fails if the file isn't
+// expectedSize bytes, since then it isn't the file the offset came from. With atomic set, a copy of the
+// file is patched and then renamed over it, so the original is never left half-written.
+bool patchFile(const char* path, u32 expectedSize, u32 offset, const u8* data, u32 size, bool atomic){
+  char tmpPath[TEMP_PATH_SIZE];
+  
+  if(!atomic) return patchFileDisk(path, expectedSize, offset, data, size);
+  
+  if(getTempPath(path, tmpPath) == false) return false;
+  if(CopyFileA(path, tmpPath, FALSE) == false){
+    logError(LOG_FILES, "ERR: Could not copy \"%s\"\n", path);
+    return false;
+  }
+  return replaceWithTemp(tmpPath, path, patchFileDisk(tmpPath, expectedSize, offset, data, size));
+}
+
+// like writeFileFragments, but writes a new file next to the original and renames it over the original
+bool replaceFileFragments(const char* path, const FileFragment* fragments, u32 count, u32 destination){
+  char tmpPath[TEMP_PATH_SIZE];
+  
+  if(destination == FILE_MAP_FILE) destination = getMapFileDestination(path); // before the path loses its extension
+  if(getTempPath(path, tmpPath) == false) return false;
+  return replaceWithTemp(tmpPath, path, writeFileFragments(tmpPath, fragments, count, destination));
+}
+
+bool getTempPath(const char* path, char* tmpPath){
+  if(strlen(path) + 5 > TEMP_PATH_SIZE){
+    logError(LOG_FILES, "ERR: Path too long \"%s\"\n", path);
+    return false;
+  }
+  sprintf(tmpPath, "%s.tmp", path);
+  return true;
+}
+
+// renames a finished temporary file over path, or deletes it if it wasn't finished
+bool replaceWithTemp(const char* tmpPath, const char* path, bool finished){
+  if(finished && MoveFileExA(tmpPath, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) == false){
+    logError(LOG_FILES, "ERR: Could not replace \"%s\"\n", path);
+    finished = false;
+  }
+  if(!finished) DeleteFileA(tmpPath);
+  return finished;
+}
+
+// checks for a file on disk without reporting anything if it's missing
+bool fileExists(const char* path){
+  DWORD attributes = GetFileAttributesA(path);
+  return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) == 0;
+}
 
 
 u8* readFileDisk(const char* path, u32* filesize){
@@ -154,25 +285,25 @@ u8* readFileDisk(const char* path, u32* filesize){
   FILE* f = fopen(path, "rb");
   if(filesize != NULL) *filesize = 0;
   if(f == NULL){
-    printf("ERR: Could not open \"%s\"\n", path);
+    logError(LOG_FILES, "ERR: Could not open \"%s\"\n", path);
     return NULL;
   }
   fseek(f, 0, SEEK_END);
   size = ftell(f);
   rewind(f);
   if(size == 0 || size == 0xFFFFFFFF){
-    printf("ERR: Could not seek \"%s\"\n", path);
+    logError(LOG_FILES, "ERR: Could not seek \"%s\"\n", path);
     fclose(f);
     return NULL;
   }
   buf = malloc(size);
   if(buf == NULL){
-    puts("ERR: Could not allocate memory\n");
+    logError(LOG_GENERAL, "ERR: Could not allocate memory\n");
     fclose(f);
     return NULL;
   }
   if(fread(buf, 1, size, f) != size){
-    printf("ERR: Could not read \"%s\"\n", path);
+    logError(LOG_FILES, "ERR: Could not read \"%s\"\n", path);
     fclose(f);
     free(buf);
     return NULL;
@@ -182,14 +313,39 @@ u8* readFileDisk(const char* path, u32* filesize){
   return buf;
 }
 
+// maps the file copy-on-write, so pages are only copied if something writes to them
+u8* mapFileDisk(const char* path, u32* filesize){
+  HANDLE file, mapping;
+  DWORD size;
+  u8* view;
+  
+  if(filesize != NULL) *filesize = 0;
+  file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if(file == INVALID_HANDLE_VALUE) return NULL;
+  size = GetFileSize(file, NULL);
+  if(size == 0 || size == INVALID_FILE_SIZE){
+    CloseHandle(file);
+    return NULL;
+  }
+  mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+  CloseHandle(file);
+  if(mapping == NULL) return NULL;
+  view = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+  CloseHandle(mapping); // the view keeps the mapping alive
+  if(view == NULL) return NULL;
+  
+  if(filesize != NULL) *filesize = size;
+  return view;
+}
+
 bool readFileFixedDisk(const char* path, void* buffer, u32 filesize){
   FILE* f = fopen(path, "rb");
   if(f == NULL){
-    printf("ERR: Could not open \"%s\"\n", path);
+    logError(LOG_FILES, "ERR: Could not open \"%s\"\n", path);
     return false;
   }
   if(buffer == NULL || fread(buffer, 1, filesize, f) != filesize){
-    printf("ERR: Could not read \"%s\"\n", path);
+    logError(LOG_FILES, "ERR: Could not read \"%s\"\n", path);
     fclose(f);
     return false;
   }
@@ -197,17 +353,44 @@ bool readFileFixedDisk(const char* path, void* buffer, u32 filesize){
   return true;
 }
 
-bool writeFileDisk(const char* path, u8* data, u32 filesize){
-  FILE* f = fopen(path, "wb");
+bool patchFileDisk(const char* path, u32 expectedSize, u32 offset, const u8* data, u32 size){
+  FILE* f = fopen(path, "r+b");
   if(f == NULL){
-    printf("ERR: Could not open \"%s\"\n", path);
+    logError(LOG_FILES, "ERR: Could not open \"%s\"\n", path);
+    return false;
+  }
+  fseek(f, 0, SEEK_END);
+  if((u32)ftell(f) != expectedSize || offset + size > expectedSize){
+    logError(LOG_FILES, "ERR: \"%s\" has changed since it was loaded\n", path);
+    fclose(f);
     return false;
   }
-  if(filesize != 0 && fwrite(data, 1, filesize, f) != filesize){
-    printf("ERR: Could not write \"%s\"\n", path);
+  if(fseek(f, offset, SEEK_SET) != 0 || fwrite(data, 1, size, f) != size){
+    logError(LOG_FILES, "ERR: Could not write \"%s\"\n", path);
     fclose(f);
     return false;
   }
+  if(fclose(f) != 0){
+    logError(LOG_FILES, "ERR: Could not write \"%s\"\n", path);
+    return false;
+  }
+  return true;
+}
+
+bool writeFileDisk(const char* path, const FileFragment* fragments, u32 count){
+  u32 i;
+  FILE* f = fopen(path, "wb");
+  if(f == NULL){
+    logError(LOG_FILES, "ERR: Could not open \"%s\"\n", path);
+    return false;
+  }
+  for(i = 0; i < count; i++){
+    if(fragments[i].size != 0 && fwrite(fragments[i].data, 1, fragments[i].size, f) != fragments[i].size){
+      logError(LOG_FILES, "ERR: Could not write \"%s\"\n", path);
+      fclose(f);
+      return false;
+    }
+  }
   fclose(f);
   return true;
 }
@@ -222,27 +405,27 @@ u8* readFileMPQ(const char* path, u32* filesize){
   if(filesize != NULL) *filesize = 0;
   
   if(SFileOpenFile(path, &hFile) == false){
-    printf("ERR: Could not find file \"%s\" in archive\n", path);
+    logError(LOG_FILES, "ERR: Could not find file \"%s\" in archive\n", path);
     return NULL;
   }
   
   size = SFileGetFileSize(hFile, NULL);
   if(size == 0 || size == 0xFFFFFFFF){
-    printf("ERR: Could not get filesize \"%s\"\n", path);
+    logError(LOG_FILES, "ERR: Could not get filesize \"%s\"\n", path);
     SFileCloseFile(hFile);
     return NULL;
   }
   
   buf = malloc(size);
   if(buf == NULL){
-    puts("ERR: Could not allocate memory\n");
+    logError(LOG_GENERAL, "ERR: Could not allocate memory\n");
     SFileCloseFile(hFile);
     return NULL;
   }
   
   SFileReadFile(hFile, buf, size, &read, NULL);
   if(read != size){
-    printf("ERR: Could not read \"%s\"\n", path);
+    logError(LOG_FILES, "ERR: Could not read \"%s\"\n", path);
     SFileCloseFile(hFile);
     free(buf);
     return NULL;
@@ -258,7 +441,7 @@ bool readFileFixedMPQ(const char* path, void* buffer, u32 filesize){
   DWORD read = 0;
   
   if(SFileOpenFile(path, &hFile) == false){
-    printf("ERR: Could not find file \"%s\" in archive\n", path);
+    logError(LOG_FILES, "ERR: Could not find file \"%s\" in archive\n", path);
     return false;
   }
   
@@ -268,7 +451,7 @@ bool readFileFixedMPQ(const char* path, void* buffer, u32 filesize){
   SFileCloseFile(hFile);
   
   if(buffer == NULL || read != filesize){
-    printf("ERR: Could not read \"%s\"\n", path);
+    logError(LOG_FILES, "ERR: Could not read \"%s\"\n", path);
     return false;
   }
   
@@ -279,11 +462,11 @@ bool readFileFixedMPQ(const char* path, void* buffer, u32 filesize){
 bool writeFileMPQ(const char* path, const char* mpqPath, u8* data, u32 filesize){
   MPQHANDLE hmpq = MpqOpenArchiveForUpdateEx(path, MOAU_CREATE_ALWAYS | MOAU_MAINTAIN_LISTFILE, 1024, DEFAULT_BLOCK_SIZE);
   if(hmpq == NULL){
-    printf("ERR: Could not open \"%s\"\n", path);
+    logError(LOG_FILES, "ERR: Could not open \"%s\"\n", path);
     return false;
   }
   if(MpqAddFileFromBuffer(hmpq, data, filesize, mpqPath, MAFA_COMPRESS2) == false){
-    printf("ERR: Could not write \"%s\"\n", path);
+    logError(LOG_FILES, "ERR: Could not write \"%s\"\n", path);
     MpqCloseUpdatedArchive(hmpq, 0);
     return false;
   }
@@ -305,27 +488,27 @@ u8* readFileCASC(const char* path, u32* filesize){
   if(filesize != NULL) *filesize = 0;
   
   if(CascOpenFile(casc, path, 0, CASC_OPEN_BY_NAME, &hFile) == false){
-    printf("ERR: Could not find file \"%s\" in archive\n", path);
+    logError(LOG_FILES, "ERR: Could not find file \"%s\" in archive\n", path);
     return NULL;
   }
   
   size = CascGetFileSize(hFile, NULL);
   if(size == 0 || size == CASC_INVALID_SIZE){
-    printf("ERR: Could not get filesize \"%s\"\n", path);
+    logError(LOG_FILES, "ERR: Could not get filesize \"%s\"\n", path);
     CascCloseFile(hFile);
     return NULL;
   }
   
   buf = malloc(size);
   if(buf == NULL){
-    puts("ERR: Could not allocate memory\n");
+    logError(LOG_GENERAL, "ERR: Could not allocate memory\n");
     CascCloseFile(hFile);
     return NULL;
   }
   
   CascReadFile(hFile, buf, size, &read);
   if(read != size){
-    printf("ERR: Could not read \"%s\"\n", path);
+    logError(LOG_FILES, "ERR: Could not read \"%s\"\n", path);
     CascCloseFile(hFile);
     free(buf);
     return NULL;
@@ -341,7 +524,7 @@ bool readFileFixedCASC(const char* path, void* buffer, u32 filesize){
   DWORD read = 0;
   
   if(CascOpenFile(casc, path, 0, CASC_OPEN_BY_NAME, &hFile) == false){
-    printf("ERR: Could not find file \"%s\" in archive\n", path);
+    logError(LOG_FILES, "ERR: Could not find file \"%s\" in archive\n", path);
     return false;
   }
   
@@ -351,7 +534,7 @@ bool readFileFixedCASC(const char* path, void* buffer, u32 filesize){
   CascCloseFile(hFile);
   
   if(buffer == NULL || read != filesize){
-    printf("ERR: Could not read \"%s\"\n", path);
+    logError(LOG_FILES, "ERR: Could not read \"%s\"\n", path);
     return false;
   }
   
@@ -402,7 +585,7 @@ char* getInstallPathCASC(){
   
   FILE* f = fopen(agentpath, "rb");
   if(f == NULL){
-    puts("Error: Could not locate Battle.net Agent data.");
+    logWarn(LOG_FILES, "Error: Could not locate Battle.net Agent data.\n");
     return;
   }
   
@@ -441,7 +624,7 @@ bool getInstallPathCASC_Proto(FILE* f, u32 start, u32 len, u32 message, char** p
       {
         // get length
         decode = varint(f, &decodeH);
-        if(decodeH != 0) puts("Nonzero high value in message length !?");
+        if(decodeH != 0) logWarn(LOG_FILES, "Nonzero high value in message length !?\n");
         
         // Different behavior depending on message type
         switch(message){
@@ -487,12 +670,12 @@ bool getInstallPathCASC_Proto(FILE* f, u32 start, u32 len, u32 message, char** p
             if(field == INSTALLATION_PATH){
               *path = malloc(decode+1);
               if((*path) == NULL){
-                puts("Error: Memory");
+                logError(LOG_GENERAL, "Error: Memory\n");
                 return true;
               }
               fread(*path, 1, decode, f);
               (*path)[decode] = 0;
-              puts(*path);
+              logDebug(LOG_FILES, "%s\n", *path);
               return true;
             }
             break;
@@ -515,7 +698,7 @@ bool getInstallPathCASC_Proto(FILE* f, u32 start, u32 len, u32 message, char** p
         fread(&decode, 1, 4, f);
         break;
       default:
-        printf("Unknown wire type %d\n", wire);
+        logWarn(LOG_FILES, "Unknown wire type %d\n", wire);
         exit = true;
     }
   }
@@ -8,11 +8,26 @@
 #define FILE_ARCHIVE   3
 #define FILE_MAP_FILE  4
 
+#define TEMP_PATH_SIZE  0x400  // for the copies made by atomic writes
+
+// a piece of a file that's written out from separate buffers
+typedef struct {
+  const u8* data;
+  u32 size;
+} FileFragment;
+
 void initArchiveData();
 void closeArchiveData();
 
+bool fileExists(const char* path);
 u8* readFile(const char* path, u32* filesize, u32 source);
+u8* mapFile(const char* path, u32* filesize, u32 source, bool* mapped);
+void unmapFile(u8* data);
 bool readFileFixed(const char* path, void* buffer, u32 filesize, u32 source);
 bool writeFile(const char* path, u8* data, u32 filesize, u32 destination);
+u32 getMapFileDestination(const char* path);
+bool writeFileFragments(const char* path, const FileFragment* fragments, u32 count, u32 destination);
+bool replaceFileFragments(const char* path, const FileFragment* fragments, u32 count, u32 destination);
+bool patchFile(const char* path, u32 expectedSize, u32 offset, const u8* data, u32 size, bool atomic);
 
 #endif
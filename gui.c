@@ -54,6 +54,8 @@ s32 winWidth = 800;
 s32 winHeight = 600;
 bool winMaximized = false;
 
+ISOMContext* isomCtx = NULL;
+
 char openFilename[1024] = "";
 char loadedExtension[4] = "";
 
@@ -74,7 +76,8 @@ LRESULT CALLBACK ImgProc(HWND, UINT, WPARAM, LPARAM);
 
 
 
-bool makeWindow(){
+bool makeWindow(ISOMContext* ctx){
+  isomCtx = ctx;
   loadOptions();
   if(initWindow(winWidth,winHeight,winMaximized) == false){
     printf("Error making window");
@@ -137,11 +140,13 @@ void openMap(const char* filename){
     for(name = strlen(filename); name > 0 && filename[name-1] != '\\'; name--);
   }
   
-  if(loadMap(filename) == false){
+  // a failed load unloads the current map, which redraw keeps reading
+  ownISOMBuffers(isomCtx);
+  if(loadMap(isomCtx, filename) == false){
     // could not load
     return;
   }
-  initISOMData();
+  initISOMData(isomCtx);
   
   initMapUI(filename + name);
 }
@@ -158,7 +163,7 @@ void saveMap(){
   
   if(getCHK(NULL) == NULL) return; // no map loaded
   
-  if(generateISOMData() == false){
+  if(generateISOMData(isomCtx) == false){
     MessageBox(0, "Error generating ISOM data.", "Error", 0);
     return;
   }
@@ -176,7 +181,7 @@ void saveMap(){
     strcpy(path + ofn.nFileExtension, loadedExtension);
   }
   
-  if(writeMap(path) == false){
+  if(writeMap(path, false) == false){
     // could not write
     return;
   }
@@ -195,7 +200,7 @@ void initMapUI(const char* titlename){
   u32 ext;
   u32 name;
   
-  copyPal(bmiMini.bmiColors);
+  copyPal(isomCtx->ts, bmiMini.bmiColors);
   
   getMapDim(&mapTileWidth, &mapTileHeight);
   mapPixelWidth = mapTileWidth*32;
@@ -247,8 +252,8 @@ void redraw(bool scroll){
     // map tiles
     for(y = y1; y < y2; y++){
       for(x = x1; x < x2; x++){
-        tile = getTileAt(x, y, &shading);
-        drawTile(mapbuf, mapBufWidth, screenHeight, (x-x1)*32 + xOffs, (y-y1)*32 + yOffs, tile, shading);
+        tile = getTileAt(isomCtx, x, y, &shading);
+        drawTile(isomCtx->ts, mapbuf, mapBufWidth, screenHeight, (x-x1)*32 + xOffs, (y-y1)*32 + yOffs, tile, shading);
       }
     }
     
@@ -284,7 +289,7 @@ void redraw(bool scroll){
         if(y2 >= mapTileHeight/2) y2 = mapTileHeight/2-1;
         break;
     }
-    drawMinimap(minibuf + yOffs*128+xOffs, 128, mapTileHeight, mapTileWidth, mapTileHeight, miniScale);
+    drawMinimap(isomCtx->ts, isomCtx->maptiles, minibuf + yOffs*128+xOffs, 128, mapTileHeight, mapTileWidth, mapTileHeight, miniScale);
     
     // minimap screen position
     for(x = x1; x <= x2; x++){
@@ -1,8 +1,9 @@
 #ifndef H_GUI
 #define H_GUI
 #include "types.h"
+#include "isom.h"
 
-bool makeWindow();
+bool makeWindow(ISOMContext* ctx);
 void setStatusText(const char* message);
 void dispError(const char* error);
 void setOpenFilename(const char* filename);
@@ -1,12 +1,21 @@
 #include "isom.h"
 #include "terrain.h"
 #include "chk.h"
+#include "files.h"
+#include "log.h"
+#include "simd.h"
+#include <math.h>
+#include <windows.h>
 
-#define ISOMCoords(x,y) ((y)*(mapw/2+1) + (x)/2)
-#define DomCoords(x,y)  (((y)+1)*(mapw+2) + (x)+2)
+// both expect an ISOMContext* ctx in scope
+#define ISOMCoords(x,y) ((y)*(ctx->mapw/2+1) + (x)/2)
+#define DomCoords(x,y)  (((y)+1)*(ctx->mapw+2) + (x)+2)
 
 #define EDGE_RSV_START   48  // 49-56 have special meanings
-#define MAX_TABLE_COUNT  48  // 38 is the highest normally used
+
+#define MIN_BAND_ROWS    16  // don't bother splitting smaller bands
+
+#define SAMPLE_Z         1.96  // normal quantile for sampleISOMData's 95% bound
 
 
 /* ----- Look-up table stuff ----- */
@@ -117,73 +126,437 @@ const struct {
   }
 };
 
-// Terrain data
+// derived TerrainTypes for each era, reused as long as the cv5 data doesn't change
 struct {
-  u8  groupType;   // basic, edge, stack
-  u8  patternType; // normal, simple, cliff, stackable cliff
-  u8  edgeA;       // plain or source CV5 edge type
-  u8  edgeB;       // final CV5 edge type
-  u8  edgeC[4];    // unique cliff IDs
-  u16 cliffUpper;  // stacked cliffs -- upper cliff CV5 id
-  u16 firstGroup;  // stacked cliffs -- first cv5 group (inclusive)
-  u16 lastGroup;   // stacked cliffs -- last cv5 group (exclusive)
-  u16 ISOMType;
-} TerrainTypes[MAX_TABLE_COUNT] = {0};
+  bool valid;
+  u32 cv5hash;
+  TerrainType types[MAX_TABLE_COUNT];
+} typeTableCache[8] = {0};
+bool typeTableCacheDirty = false;
+SRWLOCK typeTableLock = SRWLOCK_INIT;
+
+// type table cache file
+typedef struct {
+  u32 magic;
+  u32 version;
+  u32 count;
+} TypeCacheHeader;
+
+typedef struct {
+  u32 era;
+  u32 cv5hash;
+  TerrainType types[MAX_TABLE_COUNT];
+} TypeCacheEntry;
+
+#define TYPE_CACHE_MAGIC    0x54545349 // "ISTT"
+#define TYPE_CACHE_VERSION  1
 
 /* ----- End Look-up table stuff ----- */
 
 
-// terrain values
-extern CV5* cv5;
-extern u32 cv5count;
-extern u16 dddata[512][256];
+// working buffer sizes for a w*h map
+#define MAPTILES_SIZE(w,h)  ((w)*(h)*sizeof(u16))
+#define ISOM_SIZE(w,h)      (((w)/2+1)*((h)+1)*sizeof(ISOMRect))
+#define GROUPS_SIZE(w,h)    ((w)*(h)*sizeof(u16))
+#define EDGES_SIZE(w,h)     (4*(w)*(h)*sizeof(u16))
+#define TILEDOMS_SIZE(w,h)  (((w)+2)*((h)+1)*sizeof(TileDomain))
+#define PLANES_SIZE(w,h)    (PLANE_COUNT*(h)*(((w)+63)/64)*sizeof(u64))
+#define TYPES_SIZE(w,h)     (((w)/2+1)*((h)+1)*4*sizeof(u16))
+#define DIRS_SIZE(w,h)      (((w)/2+1)*((h)+1)*4*sizeof(u8))
+#define RUNS_SIZE(w,h)      ((w)*(h)*sizeof(u8))
+
+#define ARENA_ALIGN    64  // keeps buffers on separate cache lines
+// every buffer for the largest map, plus room for two ISOM-sized scratch buffers and a mismatch bitmap
+#define ARENA_SIZE     (MAPTILES_SIZE(MAX_MAP_DIM,MAX_MAP_DIM) + ISOM_SIZE(MAX_MAP_DIM,MAX_MAP_DIM) + GROUPS_SIZE(MAX_MAP_DIM,MAX_MAP_DIM) \
+                        + EDGES_SIZE(MAX_MAP_DIM,MAX_MAP_DIM) + TILEDOMS_SIZE(MAX_MAP_DIM,MAX_MAP_DIM) + PLANES_SIZE(MAX_MAP_DIM,MAX_MAP_DIM) \
+                        + TYPES_SIZE(MAX_MAP_DIM,MAX_MAP_DIM) + DIRS_SIZE(MAX_MAP_DIM,MAX_MAP_DIM) + RUNS_SIZE(MAX_MAP_DIM,MAX_MAP_DIM) \
+                        + 2*ISOM_SIZE(MAX_MAP_DIM,MAX_MAP_DIM) + ISOM_SIZE(MAX_MAP_DIM,MAX_MAP_DIM)/16 + 16*ARENA_ALIGN)
+
+// row y of a tile flag plane (also expects ctx)
+#define TilePlane(plane,y) (&ctx->tilePlanes[((plane)*ctx->maph + (y))*ctx->planeWords])
+
+// cv5 edge values of every tile on one side, indexed like groups (also expects ctx)
+#define EdgePlane(side)    (&ctx->edges[(side)*ctx->mapw*ctx->maph])
+#define SIDE_LEFT   0  // also the ISOMRect value order
+#define SIDE_UP     1
+#define SIDE_RIGHT  2
+#define SIDE_DOWN   3
+
+// one side of an ISOM rect from the split planes (also expects ctx)
+#define ISOMType(i,side)   (ctx->isomTypes[(i)*4 + (side)])
+#define ISOMDir(i,side)    (ctx->isomDirs[(i)*4 + (side)])
+
+// ISOMPatterns entry i compiled for terrain type id (also expects ctx)
+#define PatternFor(id,i)   (&ctx->patterns[(id)*ISOM_EDGE_COUNT + (i)])
+
+// getISOMCellType results that aren't ISOM types
+#define ISOM_CELL_MIXED  0xFFFF
+#define ISOM_CELL_NONE   0xFFFE
+
+
+void* arenaAlloc(ISOMArena* arena, u32 size);
+void layoutISOMBuffers(ISOMContext* ctx, bool clear);
+
+// one horizontal slice of a map, analyzed on its own thread
+typedef struct ISOMBand ISOMBand;
+typedef void (*ISOMBandFunc)(ISOMContext* ctx, ISOMBand* band);
+struct ISOMBand {
+  ISOMContext ctx;  // shallow copy -- shares map buffers, has its own classifier cache and counters
+  ISOMBandFunc func;
+  void* arg;
+  s32 y0,y1;        // rows [y0,y1)
+  
+  // writes into row y1 belong to the next band and are merged after every band finishes
+  u16 halo[MAX_MAP_DIM+2];
+  bool hasHalo;
+  
+  // per-band results
+  u32 cellsChecked;
+  u32 cellsValid;
+  u32 singleGrids;
+  u8 hasGridSet[16];
+};
 
+u32 runISOMBands(ISOMContext* ctx, ISOMBandFunc func, void* arg, s32 first, s32 last, ISOMBand** result);
+void markTileDoms(ISOMContext* ctx, ISOMBand* band, s32 x, s32 y, u32 count, u16 flags);
+void setTilePlanes(ISOMContext* ctx, s32 x, s32 y, u16 flags);
+void clearTilePlanes(ISOMContext* ctx, s32 x, s32 y, u16 flags);
+u16 getTilePlaneFlags(ISOMContext* ctx, s32 x, s32 y);
+
+bool loadISOMInputs(ISOMContext* ctx, bool clear);
+void parseTiles(ISOMContext* ctx);
+void readTileGroups(ISOMContext* ctx, s32 y0, s32 y1);
+void parseTileGroupsBand(ISOMContext* ctx, ISOMBand* band);
+void parseTilesBand(ISOMContext* ctx, ISOMBand* band);
+bool validateTILE(ISOMContext* ctx);
+bool validateISOM(ISOMContext* ctx, u32* cellsChecked, u32* cellsValid);
+void validateISOMBand(ISOMContext* ctx, ISOMBand* band);
+bool isISOMCellValid(ISOMContext* ctx, s32 x, s32 y, u32 id);
+void readTileAt(ISOMContext* ctx, s32 x, s32 y);
+void readISOMCellInputs(ISOMContext* ctx, s32 x, s32 y);
+u32 nextSampleRandom(u32* state);
+
+void generateISOMGrids(ISOMContext* ctx);
+void findISOMGridsBand(ISOMContext* ctx, ISOMBand* band);
+void countISOMGridsBand(ISOMContext* ctx, ISOMBand* band);
+void keepISOMGridBand(ISOMContext* ctx, ISOMBand* band);
+void labelISOMDomains(ISOMContext* ctx);
+u32 findDomainRoot(u32* parent, u32 i);
+Domain* addDomain(ISOMContext* ctx);
+
+u32 getISOMTypeAt(ISOMContext* ctx, s32 x, s32 y);
+bool isISOMCellAt(ISOMContext* ctx, s32 x, s32 y);
+bool isEmptyISOMCellAt(ISOMContext* ctx, s32 x, s32 y);
+bool doesISOMCellEqualType(ISOMContext* ctx, s32 x, s32 y, u32 type);
+u32 getISOMCellType(ISOMContext* ctx, s32 x, s32 y);
+bool isISOMPartialEdge(ISOMContext* ctx, s32 x, s32 y, u32 type, u32 rectSide);
+void setISOMCellAt(ISOMContext* ctx, s32 x, s32 y, u32 type);
 
-// chk data
-u32 tileset = 0;
-s32 mapw = 0;
-s32 maph = 0;
-u16 maptiles[MAX_MAP_DIM*MAX_MAP_DIM] = {0};
-ISOMRect isom[MAX_ISOM_WIDTH*MAX_ISOM_HEIGHT] = {0};
+//u32 getCustomISOM(s32 x, s32 y);
+bool checkISOMTiles(u16 tiles[], u16 flags[]);
+u32 getRectISOMType(ISOMContext* ctx, u16 tiles[], s32 x, s32 y);
+void getRectEdges(ISOMContext* ctx, const u16 tiles[], s32 x, s32 y, u32 edgeTypes[]);
+u32 computeRectISOMType(ISOMContext* ctx, u16 tiles[], const u32 edgeTypes[]);
 
+void loadTypeTables(ISOMContext* ctx);
+void generateTypeTables(ISOMContext* ctx);
+void generatePartialEdgeSets(ISOMContext* ctx);
+bool generateHotGroups(ISOMContext* ctx);
 
-// isom parsing data
-u16 groups[MAX_MAP_DIM*MAX_MAP_DIM] = {0};
-u16 edges[MAX_ISOM_WIDTH*MAX_ISOM_HEIGHT*2] = {0};
+u32 resolvePatternEdge(ISOMContext* ctx, u32 pattern, u32 id);
+void compilePatterns(ISOMContext* ctx);
+bool edgeMatchesType(ISOMContext* ctx, u16 edge, u32 id);
+u32 getCV5Index(ISOMContext* ctx, u16 tile);
+u32 getISOMFromBasicEdge(ISOMContext* ctx, u16 id);
+bool isBasicGroup(ISOMContext* ctx, u16 group);
 
-TileDomain tileDoms[(MAX_MAP_DIM+1)*(MAX_MAP_DIM+2)] = {0};
-Domain domains[65536] = {0};
-u32 domainCount = 0;
 
 
-void parseTiles();
-bool validateTILE();
-bool validateISOM(u32* cellsChecked, u32* cellsValid);
+ISOMContext* createISOMContext(){
+  ISOMContext* ctx = calloc(1, sizeof(ISOMContext));
+  if(ctx == NULL){
+    logError(LOG_GENERAL, "Could not allocate memory :(\n");
+    return NULL;
+  }
+  
+  // map buffers are carved out of the arena by initISOMData -- only the part a map uses ever gets touched
+  ctx->arena.base = malloc(ARENA_SIZE);
+  ctx->arena.size = ARENA_SIZE;
+  ctx->arena.mapw = -1;
+  ctx->rectCache = malloc(RECT_CACHE_SIZE*sizeof(RectCacheEntry));
+  ctx->partialEdges = malloc(sizeof(PartialEdgeSets));
+  ctx->patterns = malloc(MAX_TABLE_COUNT*ISOM_EDGE_COUNT*sizeof(CompiledPattern));
+  if(ctx->arena.base == NULL || ctx->rectCache == NULL || ctx->partialEdges == NULL || ctx->patterns == NULL){
+    logError(LOG_GENERAL, "Could not allocate memory :(\n");
+    freeISOMContext(ctx);
+    return NULL;
+  }
+  
+  ctx->rectCacheEra = 0xFFFFFFFF;
+  ctx->bands = 1;
+  return ctx;
+}
 
-void generateISOMGrids();
+void freeISOMContext(ISOMContext* ctx){
+  if(ctx == NULL) return;
+  releaseTileset(ctx->ts);
+  if(ctx->arena.base != NULL) free(ctx->arena.base);
+  if(ctx->domains != NULL) free(ctx->domains);
+  if(ctx->rectCache != NULL) free(ctx->rectCache);
+  if(ctx->partialEdges != NULL) free(ctx->partialEdges);
+  if(ctx->hotGroups != NULL) free(ctx->hotGroups);
+  if(ctx->patterns != NULL) free(ctx->patterns);
+  free(ctx);
+}
 
-u32 getISOMTypeAt(s32 x, s32 y);
-bool isISOMCellAt(s32 x, s32 y);
-bool isEmptyISOMCellAt(s32 x, s32 y);
-bool doesISOMCellEqualType(s32 x, s32 y, u32 type);
-bool isISOMPartialEdge(s32 x, s32 y, u32 type, u32 rectSide);
-void setISOMCellAt(s32 x, s32 y, u32 type);
+void* arenaAlloc(ISOMArena* arena, u32 size){
+  void* ptr;
+  size = (size + ARENA_ALIGN-1) & ~(ARENA_ALIGN-1);
+  if(arena->used + size > arena->size) return NULL;
+  ptr = arena->base + arena->used;
+  arena->used += size;
+  return ptr;
+}
+
+// lays out the map buffers for the current map size, or keeps them if the size hasn't changed --
+// without clear, the per-tile buffers keep whatever was left in them
+void layoutISOMBuffers(ISOMContext* ctx, bool clear){
+  s32 w = ctx->mapw;
+  s32 h = ctx->maph;
+  
+  if(w != ctx->arena.mapw || h != ctx->arena.maph){
+    ctx->arena.used = 0;
+    ctx->tileCopy = arenaAlloc(&ctx->arena, MAPTILES_SIZE(w,h));
+    ctx->isomCopy = arenaAlloc(&ctx->arena, ISOM_SIZE(w,h));
+    ctx->groups = arenaAlloc(&ctx->arena, GROUPS_SIZE(w,h));
+    ctx->edges = arenaAlloc(&ctx->arena, EDGES_SIZE(w,h));
+    ctx->tileDoms = arenaAlloc(&ctx->arena, TILEDOMS_SIZE(w,h));
+    ctx->tilePlanes = arenaAlloc(&ctx->arena, PLANES_SIZE(w,h));
+    ctx->isomTypes = arenaAlloc(&ctx->arena, TYPES_SIZE(w,h));
+    ctx->isomDirs = arenaAlloc(&ctx->arena, DIRS_SIZE(w,h));
+    ctx->basicRuns = arenaAlloc(&ctx->arena, RUNS_SIZE(w,h));
+    ctx->planeWords = (w+63)/64;
+    ctx->arena.mark = ctx->arena.used;
+    ctx->arena.mapw = w;
+    ctx->arena.maph = h;
+  }
+  
+  ctx->maptiles = ctx->tileCopy;
+  ctx->isom = ctx->isomCopy;
+  if(!clear) return;
+  memset(ctx->groups, 0, GROUPS_SIZE(w,h));
+  memset(ctx->edges, 0, EDGES_SIZE(w,h));
+  memset(ctx->basicRuns, 0, RUNS_SIZE(w,h));
+  memset(ctx->tileDoms, 0, TILEDOMS_SIZE(w,h));
+  memset(ctx->tilePlanes, 0, PLANES_SIZE(w,h));
+}
+
+// temporary buffer that lives until resetISOMScratch or until a map of a different size is initialized
+void* allocISOMScratch(ISOMContext* ctx, u32 size){
+  void* ptr = arenaAlloc(&ctx->arena, size);
+  if(ptr == NULL) logError(LOG_GENERAL, "Could not allocate memory :(\n");
+  return ptr;
+}
+
+void resetISOMScratch(ISOMContext* ctx){
+  if(ctx->arena.mapw >= 0) ctx->arena.used = ctx->arena.mark;
+}
 
-//u32 getCustomISOM(s32 x, s32 y);
-bool checkISOMTiles(u16 tiles[], u16 flags[]);
-u32 getRectISOMType(u16 tiles[]);
 
-void generateTypeTables();
 
-bool edgeMatches(u32 edge, u32 pattern, u32 id);
-bool edgeMatchesType(u16 edge, u32 id);
-u32 getCV5Index(u16 tile);
-u32 getISOMFromBasicEdge(u16 id);
-bool isBasicGroup(u16 group);
+/* ----- Row bands ----- */
 
+DWORD WINAPI bandThread(LPVOID param){
+  ISOMBand* band = (ISOMBand*)param;
+  band->func(&band->ctx, band);
+  logFlush();
+  return 0;
+}
 
+// splits rows [first,last) into up to ctx->bands bands and runs func on each in parallel,
+// then merges halo rows and classifier stats -- caller frees *result
+u32 runISOMBands(ISOMContext* ctx, ISOMBandFunc func, void* arg, s32 first, s32 last, ISOMBand** result){
+  u32 count = ctx->bands;
+  u32 i;
+  s32 x;
+  ISOMBand* bands;
+  HANDLE* threads = NULL;
+  
+  if(count > (last-first)/MIN_BAND_ROWS) count = (last-first)/MIN_BAND_ROWS;
+  if(count < 1) count = 1;
+  
+  bands = calloc(count, sizeof(ISOMBand));
+  if(count > 1) threads = calloc(count, sizeof(HANDLE));
+  if(bands == NULL || (count > 1 && threads == NULL)){
+    if(bands != NULL) free(bands);
+    bands = calloc(1, sizeof(ISOMBand));
+    if(bands == NULL){
+      logError(LOG_GENERAL, "Could not allocate memory :(\n");
+      *result = NULL;
+      return 0;
+    }
+    count = 1;
+  }
+  
+  for(i = 0; i < count; i++){
+    bands[i].ctx = *ctx;
+    bands[i].func = func;
+    bands[i].arg = arg;
+    bands[i].y0 = first + (last-first)*i/count;
+    bands[i].y1 = first + (last-first)*(i+1)/count;
+    bands[i].ctx.rectCacheHits = 0;
+    bands[i].ctx.rectCacheLookups = 0;
+    if(i == 0) continue; // the first band runs here and can use the context's own cache
+    
+    // the rest start from a copy of it
+    bands[i].ctx.rectCache = malloc(RECT_CACHE_SIZE*sizeof(RectCacheEntry));
+    if(bands[i].ctx.rectCache == NULL){
+      logError(LOG_GENERAL, "Could not allocate memory :(\n");
+      break;
+    }
+    memcpy(bands[i].ctx.rectCache, ctx->rectCache, RECT_CACHE_SIZE*sizeof(RectCacheEntry));
+  }
+  if(i < count){
+    // couldn't set up every band -- run serially instead
+    while(i > 1) free(bands[--i].ctx.rectCache);
+    count = 1;
+    bands[0].y1 = last;
+  }
+  
+  for(i = 1; i < count; i++){
+    threads[i] = CreateThread(NULL, 0, bandThread, &bands[i], 0, NULL);
+  }
+  func(&bands[0].ctx, &bands[0]);
+  for(i = 1; i < count; i++){
+    if(threads[i] != NULL){
+      WaitForSingleObject(threads[i], INFINITE);
+      CloseHandle(threads[i]);
+    }else{
+      func(&bands[i].ctx, &bands[i]); // couldn't start a thread
+    }
+    free(bands[i].ctx.rectCache);
+  }
+  if(threads != NULL) free(threads);
+  
+  for(i = 0; i < count; i++){
+    ctx->rectCacheHits += bands[i].ctx.rectCacheHits;
+    ctx->rectCacheLookups += bands[i].ctx.rectCacheLookups;
+    if(bands[i].hasHalo){
+      for(x = -2; x < ctx->mapw; x++){
+        ctx->tileDoms[DomCoords(x,bands[i].y1)].flags |= bands[i].halo[x+2];
+        setTilePlanes(ctx, x, bands[i].y1, bands[i].halo[x+2]);
+      }
+    }
+  }
+  
+  *result = bands;
+  return count;
+}
+
+// sets flags on count tiles starting at x,y -- rows past the band go to its halo
+void markTileDoms(ISOMContext* ctx, ISOMBand* band, s32 x, s32 y, u32 count, u16 flags){
+  s32 domIndex = DomCoords(x,y);
+  u32 i;
+  if(y >= band->y1){
+    for(i = 0; i < count; i++){
+      band->halo[x+2+i] |= flags;
+    }
+    band->hasHalo = true;
+  }else{
+    for(i = 0; i < count; i++){
+      ctx->tileDoms[domIndex+i].flags |= flags;
+      setTilePlanes(ctx, x+i, y, flags);
+    }
+  }
+}
+
+// sets flags in the bit planes -- margin tiles outside the map only have TileDomain flags
+void setTilePlanes(ISOMContext* ctx, s32 x, s32 y, u16 flags){
+  u32 plane;
+  if(x < 0 || y < 0 || x >= ctx->mapw || y >= ctx->maph) return;
+  for(plane = 0; flags >> plane; plane++){
+    if((flags >> plane) & 1) TilePlane(plane,y)[x >> 6] |= (u64)1 << (x & 63);
+  }
+}
+
+void clearTilePlanes(ISOMContext* ctx, s32 x, s32 y, u16 flags){
+  u32 plane;
+  if(x < 0 || y < 0 || x >= ctx->mapw || y >= ctx->maph) return;
+  for(plane = 0; flags >> plane; plane++){
+    if((flags >> plane) & 1) TilePlane(plane,y)[x >> 6] &= ~((u64)1 << (x & 63));
+  }
+}
 
-bool initISOMData(){
+u16 getTilePlaneFlags(ISOMContext* ctx, s32 x, s32 y){
+  u32 plane;
+  u16 flags = 0;
+  for(plane = 0; plane < PLANE_COUNT; plane++){
+    flags |= ((TilePlane(plane,y)[x >> 6] >> (x & 63)) & 1) << plane;
+  }
+  return flags;
+}
+
+
+
+// reads the map's tiles and ISOM data into the context and makes sure the era's look-up tables are ready --
+// clear can only be skipped by callers that fill in every tile they read, like readISOMCellInputs
+bool loadISOMInputs(ISOMContext* ctx, bool clear){
+  // get map data
+  ctx->tileset = getMapEra();
+  getMapDim(&ctx->mapw, &ctx->maph);
+  if(ctx->mapw > MAX_MAP_DIM || ctx->maph > MAX_MAP_DIM){
+    ctx->mapw = 0;
+    ctx->maph = 0;
+  }
+  layoutISOMBuffers(ctx, clear);
+  
+  // read tiles and ISOM straight from the CHK when it has them -- ownISOMBuffers copies them before any writes
+  if(getMapMTXMView() != NULL){
+    ctx->maptiles = (u16*)getMapMTXMView();
+  }else{
+    getMapMTXM(ctx->maptiles);
+  }
+  if(getMapISOMView() != NULL){
+    ctx->isom = (ISOMRect*)getMapISOMView();
+  }else{
+    memset(ctx->isom, 0, ISOM_SIZE(ctx->mapw,ctx->maph)); // getMapISOM leaves it alone without an ISOM section
+    getMapISOM(ctx->isom);
+  }
+  
+  // generate look-up tables
+  loadTypeTables(ctx);
+  if(ctx->rectCacheEra != ctx->tileset || ctx->rectCacheHash != ctx->ts->cv5hash){
+    if(generateHotGroups(ctx) == false){
+      setStatusText("Could not allocate memory :(");
+      return false;
+    }
+    compilePatterns(ctx);
+    memset(ctx->rectCache, 0, RECT_CACHE_SIZE*sizeof(RectCacheEntry));
+    generatePartialEdgeSets(ctx);
+    ctx->rectCacheEra = ctx->tileset;
+    ctx->rectCacheHash = ctx->ts->cv5hash;
+  }
+  ctx->rectCacheHits = 0;
+  ctx->rectCacheLookups = 0;
+  
+  ctx->domainCount = 0;
+  return true;
+}
+
+// switches the tile and ISOM buffers from views of the CHK to the context's own copies --
+// call before anything detaches or unloads a CHK the context is still reading
+void ownISOMBuffers(ISOMContext* ctx){
+  if(ctx->maptiles != ctx->tileCopy){
+    memcpy(ctx->tileCopy, ctx->maptiles, MAPTILES_SIZE(ctx->mapw,ctx->maph));
+    ctx->maptiles = ctx->tileCopy;
+  }
+  if(ctx->isom != ctx->isomCopy){
+    memcpy(ctx->isomCopy, ctx->isom, ISOM_SIZE(ctx->mapw,ctx->maph));
+    ctx->isom = ctx->isomCopy;
+  }
+}
+
+bool initISOMData(ISOMContext* ctx){
   bool hasTILE = false;
   bool validTILE = false;
   bool hasISOM = false;
@@ -193,29 +566,15 @@ bool initISOMData(){
   char statusText[260] = "File loaded successfully!";
   char* textAppend = statusText + strlen(statusText);
   
-  // get map data
-  tileset = getMapEra();
-  getMapDim(&mapw, &maph);
-  getMapMTXM(maptiles);
-  getMapISOM(isom);
-  
-  // generate look-up tables
-  generateTypeTables();
-  
-  // clear buffers
-  memset(groups, 0, sizeof(groups));
-  memset(edges, 0, sizeof(edges));
-  memset(tileDoms, 0, sizeof(tileDoms));
-  memset(domains, 0, sizeof(domains));
-  domainCount = 0;
+  if(loadISOMInputs(ctx, true) == false) return false;
   
   // set tile flags & determine valid ISOM regions
-  parseTiles();
+  parseTiles(ctx);
   
   // check if TILE and MTXM match
   if(hasTILEData() && hasMTXMData()){
     hasTILE = true;
-    validTILE = validateTILE();
+    validTILE = validateTILE(ctx);
     if(validTILE){
       strcpy(textAppend, " -- TILE and MTXM match");
     }else{
@@ -226,7 +585,7 @@ bool initISOMData(){
   
   if(hasISOMData()){
     hasISOM = true;
-    validISOM = validateISOM(&cellsChecked, &cellsValid);
+    validISOM = validateISOM(ctx, &cellsChecked, &cellsValid);
     if(cellsChecked != 0){
       sprintf(textAppend, " -- %d of %d cells match -- Map ISOM data %s", cellsValid, cellsChecked, validISOM?"valid!":"invalid");
     }else{
@@ -239,73 +598,189 @@ bool initISOMData(){
   textAppend += strlen(textAppend);
   
   if(!validISOM){
-    puts("Generate w/e");
-    generateISOMGrids();
+    logDebug(LOG_GRIDS, "Generate w/e\n");
+    generateISOMGrids(ctx);
     
     // find ISOM domains
     
-    if(domainCount == 1){
+    if(ctx->domainCount == 1 && (ctx->domains[0].flags & DOM_SINGLE_GRID)){
       strcpy(textAppend, " -- Single grid domain");
       textAppend += strlen(textAppend);
-      if(((domains[0].flags & TILE_ISOM_GRID) & (DOM_ISOM_GRID_1|DOM_ISOM_GRID_3)) == 0){
+      if(((ctx->domains[0].flags & TILE_ISOM_GRID) & (DOM_ISOM_GRID_1|DOM_ISOM_GRID_3)) == 0){
         strcpy(textAppend, " (valid ISOM)");
       }else{
         strcpy(textAppend, " (horizontal misalignment)");
       }
+    }else if(ctx->domainCount != 0){
+      sprintf(textAppend, " -- %d grid domains", ctx->domainCount);
     }
   }
   
+  if(ctx->rectCacheLookups != 0){
+    logDebug(LOG_TYPES, "Classifier cache: %d of %d lookups hit (%d%%)\n", ctx->rectCacheHits, ctx->rectCacheLookups, (u32)((u64)ctx->rectCacheHits*100/ctx->rectCacheLookups));
+  }
+  
+  logFlush();
   setStatusText(statusText);
   return validISOM;
 }
 
 
 
-bool generateISOMData(){
+bool generateISOMData(ISOMContext* ctx){
   s32 x,y;
   u32 gridID;
   u32 gridFlag;
   s32 domIndex;
   u32 domain;
+  u32 i;
   
-  puts("generate ISOM data");
+  logDebug(LOG_GENERAL, "generate ISOM data\n");
   
   // memset(isom, 0, sizeof(isom)); ?
   
-  if((domains[0].flags & DOM_SINGLE_GRID) && (domains[0].flags & (DOM_ISOM_GRID_1|DOM_ISOM_GRID_3))){
-    puts("impossible ISOM grid");
+  // ISOM cells can't start on odd columns, so domains on grids 1 and 3 are left alone
+  for(i = 0; i < ctx->domainCount; i++){
+    if((ctx->domains[i].flags & (DOM_ISOM_GRID_1|DOM_ISOM_GRID_3)) == 0) break;
+  }
+  if(ctx->domainCount != 0 && i == ctx->domainCount){
+    logWarn(LOG_GRIDS, "impossible ISOM grid\n");
     return false;
   }
   
-  for(y = -1; y < maph; y++){
-    for(x = -2; x < mapw; x++){
+  // setCHKData may move the CHK, so nothing can be left pointing into it
+  ownISOMBuffers(ctx);
+  
+  for(y = -1; y < ctx->maph; y++){
+    for(x = -2; x < ctx->mapw; x++){
       domIndex = DomCoords(x,y);
       gridID = (4 - 2*(y&1) - x) & 3;
       gridFlag = DOM_ISOM_GRID_0 << gridID;
-      domain = tileDoms[domIndex].domain;
+      domain = ctx->tileDoms[domIndex].domain;
       
       if(domain == DOMAIN_NONE) continue;
       
-      if((domains[domain].flags & DOM_SINGLE_GRID) && (domains[domain].flags & TILE_ISOM_GRID) == gridFlag){
-        setISOMCellAt(x, y, tileDoms[domIndex].isomType);
+      if((ctx->domains[domain].flags & TILE_ISOM_GRID) == gridFlag && (gridFlag & (DOM_ISOM_GRID_1|DOM_ISOM_GRID_3)) == 0){
+        setISOMCellAt(ctx, x, y, ctx->tileDoms[domIndex].isomType);
+      }
+    }
+  }
+  
+  setCHKData(CHK_ISOM, ctx->isom);
+  logFlush();
+  
+  return true;
+}
+
+// replaces a rectangle of tiles (width*height, row by row) and regenerates only the ISOM around it --
+// falls back to a full pass if the map has no single ISOM grid yet or the change doesn't fit on it
+bool updateISOMRect(ISOMContext* ctx, const u16* tiles, s32 left, s32 top, s32 width, s32 height){
+  s32 x,y,i,j;
+  s32 x0,y0,x1,y1;
+  s32 cx0,cy0,cx1,cy1;
+  s32 domIndex;
+  u32 gridID, singleGridID;
+  u16 singleGrid;
+  ISOMBand* bands;
+  
+  if(ctx->ts == NULL || tiles == NULL) return false;
+  
+  // clip to the map
+  x0 = (left < 0) ? 0 : left;
+  y0 = (top < 0) ? 0 : top;
+  x1 = (left+width > ctx->mapw) ? ctx->mapw : left+width;
+  y1 = (top+height > ctx->maph) ? ctx->maph : top+height;
+  if(x0 >= x1 || y0 >= y1) return true;
+  
+  ownISOMBuffers(ctx);
+  for(y = y0; y < y1; y++){
+    for(x = x0; x < x1; x++){
+      ctx->maptiles[y*ctx->mapw + x] = tiles[(y-top)*width + (x-left)];
+    }
+  }
+  setMapTileRows(ctx->maptiles, y0, y1-y0);
+  
+  if(ctx->domainCount != 1 || (ctx->domains[0].flags & DOM_SINGLE_GRID) == 0){
+    if(initISOMData(ctx)) return true;
+    return generateISOMData(ctx);
+  }
+  singleGrid = ctx->domains[0].flags & TILE_ISOM_GRID;
+  if(singleGrid & (DOM_ISOM_GRID_1|DOM_ISOM_GRID_3)){
+    // same refusal as generateISOMData -- ISOM cells can't start on odd columns
+    logWarn(LOG_GRIDS, "impossible ISOM grid\n");
+    return false;
+  }
+  for(singleGridID = 0; singleGrid != (TILE_ISOM_GRID_0 << singleGridID); singleGridID++);
+  
+  // reparse the changed rows -- tile flags only depend on their own row
+  for(y = y0; y < y1; y++){
+    for(x = 0; x < ctx->mapw; x++){
+      ctx->tileDoms[DomCoords(x,y)].flags &= TILE_ISOM_GRID;
+    }
+    memset(TilePlane(PLANE_MISMATCH_UP,y), 0, ctx->planeWords*sizeof(u64));
+    memset(TilePlane(PLANE_MISMATCH_DOWN,y), 0, ctx->planeWords*sizeof(u64));
+  }
+  if(runISOMBands(ctx, parseTilesBand, NULL, y0, y1, &bands) == 0) return false;
+  free(bands);
+  
+  // rects that cover a tile whose flags could have changed (one tile past the rectangle on each side)
+  cx0 = (x0-4 < -2) ? -2 : x0-4;
+  cx1 = (x1+1 > ctx->mapw) ? ctx->mapw : x1+1;
+  cy0 = y0-1;
+  cy1 = y1;
+  for(y = cy0; y < cy1; y++){
+    for(x = cx0; x < cx1; x++){
+      domIndex = DomCoords(x,y);
+      gridID = (4 - 2*(y&1) - x) & 3;
+      ctx->tileDoms[domIndex].isomType = getISOMTypeAt(ctx, x,y);
+      ctx->tileDoms[domIndex].domain = (gridID == singleGridID) ? 0 : DOMAIN_NONE;
+    }
+  }
+  
+  // redo the grid flag of every tile those rects cover, then make sure the grid still covers every valid tile
+  for(y = cy0; y <= cy1 && y < ctx->maph; y++){
+    for(x = cx0; x < cx1+3 && x < ctx->mapw; x++){
+      domIndex = DomCoords(x,y);
+      ctx->tileDoms[domIndex].flags &= ~singleGrid;
+      clearTilePlanes(ctx, x, y, singleGrid);
+      for(j = y-1; j <= y; j++){
+        if(j < -1) continue;
+        for(i = x-3; i <= x; i++){
+          if(i < -2 || ((4 - 2*(j&1) - i) & 3) != singleGridID) continue;
+          if(ctx->tileDoms[DomCoords(i,j)].isomType != 0){
+            ctx->tileDoms[domIndex].flags |= singleGrid;
+            setTilePlanes(ctx, x, y, singleGrid);
+          }
+        }
+      }
+      if(x >= 0 && y >= 0 && (ctx->tileDoms[domIndex].flags & (TILE_INVALID_ISOM | singleGrid)) == 0){
+        logDebug(LOG_GRIDS, "Tile change needs a different ISOM grid\n");
+        if(initISOMData(ctx)) return true;
+        return generateISOMData(ctx);
       }
-      
-      // multiple domains ???
     }
   }
   
-  setCHKData(CHK_ISOM, isom);
+  for(y = cy0; y < cy1; y++){
+    for(x = cx0; x < cx1; x++){
+      if(((4 - 2*(y&1) - x) & 3) == singleGridID){
+        setISOMCellAt(ctx, x, y, ctx->tileDoms[DomCoords(x,y)].isomType);
+      }
+    }
+  }
   
+  // setISOMCellAt writes ISOM rows y and y+1
+  setMapISOMRows(ctx->isom, (cy0 < 0) ? 0 : cy0, cy1+1 - ((cy0 < 0) ? 0 : cy0));
   return true;
 }
 
 
 // returns MTXM tile and tile drawing properties
-u16 getTileAt(u32 x, u32 y, RGBA* shading){
-  if(x >= mapw || y >= maph) return 0;
+u16 getTileAt(ISOMContext* ctx, u32 x, u32 y, RGBA* shading){
+  if(x >= ctx->mapw || y >= ctx->maph) return 0;
   
   if(shading != NULL){
-    u32 flags = tileDoms[DomCoords(x,y)].flags;
+    u32 flags = ctx->tileDoms[DomCoords(x,y)].flags;
     
     // get shading
     if(flags & TILE_INVALID_ISOM){
@@ -344,7 +819,7 @@ u16 getTileAt(u32 x, u32 y, RGBA* shading){
     }
   }
   
-  return getMTXMTile(x,y);
+  return ctx->maptiles[y*ctx->mapw + x];
 }
 
 
@@ -353,116 +828,160 @@ u16 getTileAt(u32 x, u32 y, RGBA* shading){
 
 
 
-void parseTiles(){
+void parseTiles(ISOMContext* ctx){
+  ISOMBand* bands;
+  if(runISOMBands(ctx, parseTilesBand, NULL, 0, ctx->maph, &bands) != 0) free(bands);
+}
+
+// group IDs, edge planes and basic runs for rows [y0,y1)
+void readTileGroups(ISOMContext* ctx, s32 y0, s32 y1){
   s32 x,y;
-  u32 i;
-  u32 group;
-  u32 mismatchMask;
-  u32 domIndex;
-  
-  // pass 1: get group IDs, set basic flags
-  for(y = 0, i = 0; y < maph; y++){
-    for(x = 0; x < mapw; x++,i++){
-      groups[i] = getCV5Index(maptiles[i]);
-      group = groups[i];
-      
-      domIndex = DomCoords(x,y);
-      
-      // is null?
-      if(cv5[group].id == 0 || ((maptiles[i] & 0xF) != 0 && cv5[maptiles[i] >> 4].tiles[maptiles[i] & 0xF] == 0)){
-        tileDoms[domIndex].flags = TILE_INVALID_ISOM;
-        continue;
-      }
-      
-      // basic flags
-      tileDoms[domIndex].flags |= group & TILE_COLUMN; // TILE_LEFT_TILE, TILE_RIGHT_TILE
-      if(isBasicGroup(group)) {
-        tileDoms[domIndex].flags |= TILE_BASIC_GROUP;
-      }
-      if(group != 0 && group != (maptiles[i] >> 4)){
-        tileDoms[domIndex].flags |= TILE_DOODAD_TILE;
-      }
-      
-      // alignment flags probably not useful since grid domains account for this?
-      
-      // misalign flags
-      if((group & TILE_COLUMN) != (x & TILE_COLUMN)){
-        //printf("%d %d\n", group, x);
-        tileDoms[domIndex].flags |= TILE_HORZ_MISALIGN;
+  u32 i, group, run;
+  const HotGroup* hot = ctx->hotGroups;
+  const u16* tileGroups = ctx->ts->tileGroups;
+  
+  for(i = y0*ctx->mapw; i < y1*ctx->mapw; i++){
+    group = tileGroups[ctx->maptiles[i]];
+    ctx->groups[i] = group;
+    EdgePlane(SIDE_LEFT)[i] = hot[group].edge[SIDE_LEFT];
+    EdgePlane(SIDE_UP)[i] = hot[group].edge[SIDE_UP];
+    EdgePlane(SIDE_RIGHT)[i] = hot[group].edge[SIDE_RIGHT];
+    EdgePlane(SIDE_DOWN)[i] = hot[group].edge[SIDE_DOWN];
+  }
+  
+  // lengths of runs of one basic terrain, counted leftwards from each run's end
+  for(y = y0; y < y1; y++){
+    run = 0;
+    for(x = ctx->mapw-1; x >= 0; x--){
+      i = y*ctx->mapw + x;
+      group = ctx->groups[i];
+      if(group == 0 || hot[group].id == 0 || !isBasicGroup(ctx, group)){
+        run = 0;
+      }else if(run != 0 && (group | TILE_COLUMN) == (ctx->groups[i+1] | TILE_COLUMN)){
+        if(run < 255) run++;
+      }else{
+        run = 1;
       }
-      // TILE_VERT_MISALIGN?
+      ctx->basicRuns[i] = run;
     }
   }
+}
+
+// only the flags checkISOMTiles reads -- no mismatch or alignment analysis, for verifyISOMData
+void parseTileGroupsBand(ISOMContext* ctx, ISOMBand* band){
+  s32 x,y;
+  u32 group;
   
-  // pass 2: set neighbor flags
-  for(y = 0, i = 0; y < maph; y++){
-    for(x = 0; x < mapw; x++,i++){
-      group = groups[i];
-      
-      // skip invalid/null tiles
-      if(tileDoms[domIndex].flags & TILE_INVALID_ISOM){
-        continue;
-      }
-      
-      // mismatch flags
-      if(x < mapw-1){
-        if(group == 0 || groups[i+1] == 0 // tile is null
-          || ((group & TILE_COLUMN) == TILE_LEFT_TILE && groups[i+1] != group+1) // right tile does not match left tile
-          //|| ((group & TILE_COLUMN) == TILE_RIGHT_TILE && !isValidISOMPair(group, groups[i+1], RIGHT)) // right tile has an invalid neighbor
-        ){
-          tileDoms[domIndex].flags |= TILE_MISMATCH_RIGHT;
-          tileDoms[domIndex+1].flags |= TILE_MISMATCH_LEFT;
-          printf("(%3d,%3d) LR mismatch %3d,%3d : {%2d,%2d,%2d,%2d}, {%2d,%2d,%2d,%2d}\n", x,y, group, groups[i+1], cv5[group].group.edge.left, cv5[group].group.edge.up, cv5[group].group.edge.right, cv5[group].group.edge.down, cv5[groups[i+1]].group.edge.left, cv5[groups[i+1]].group.edge.up, cv5[groups[i+1]].group.edge.right, cv5[groups[i+1]].group.edge.down);
+  readTileGroups(ctx, band->y0, band->y1);
+  for(y = band->y0; y < band->y1; y++){
+    for(x = 0; x < ctx->mapw; x++){
+      group = ctx->groups[y*ctx->mapw + x];
+      if(group == 0 || ctx->hotGroups[group].id == 0) continue;
+      ctx->tileDoms[DomCoords(x,y)].flags = (group & TILE_COLUMN) | (isBasicGroup(ctx, group) ? TILE_BASIC_GROUP : 0);
+    }
+  }
+}
+
+// both passes only touch the current row, so bands need no halo
+void parseTilesBand(ISOMContext* ctx, ISOMBand* band){
+  s32 x,y;
+  u32 i,w,b;
+  u32 group, next;
+  u64 bit, inRow, hasLeft, hasRight;
+  u64 column, basic, doodad, invalid, pairs;
+  u64 valid, mismatchLeft, mismatchRight, carry, allMismatched;
+  u32 words = (ctx->mapw + 63) / 64;
+  const HotGroup* hot = ctx->hotGroups;
+  
+  // pass 1: get group IDs and their edges, set basic flags
+  readTileGroups(ctx, band->y0, band->y1);
+  for(y = band->y0; y < band->y1; y++){
+    carry = 0;
+    for(w = 0; w < words; w++){
+      column = basic = doodad = invalid = pairs = 0;
+      for(b = 0; b < 64 && w*64+b < ctx->mapw; b++){
+        x = w*64 + b;
+        i = y*ctx->mapw + x;
+        bit = (u64)1 << b;
+        group = ctx->groups[i];
+        
+        // is null?
+        if(group == 0 || hot[group].id == 0){ // tileGroups is already 0 for tiles with no graphics
+          invalid |= bit;
+          continue;
+        }
+        
+        // basic flags
+        if(hot[group].flags & HOT_RIGHT_TILE) column |= bit; // TILE_LEFT_TILE, TILE_RIGHT_TILE
+        if(isBasicGroup(ctx, group)) basic |= bit;
+        if(group != (ctx->maptiles[i] >> 4)) doodad |= bit;
+        
+        // does the right tile pair with this one?
+        if(x < ctx->mapw-1){
+          next = ctx->groups[i+1];
+          if(next != 0 && ((group & TILE_COLUMN) == TILE_RIGHT_TILE || next == group+1)){ // right tiles don't check isValidISOMPair yet
+            pairs |= bit;
+          }
         }
-      }
-      if(y < maph-1){
-        /*if(groups[i] == 0 || groups[i+mapw] == 0 || !isValidISOMPair(group, groups[i+mapw], DOWN)){
-          tileDoms[domIndex].flags |= TILE_MISMATCH_DOWN;
-          tileDoms[domIndex+mapw+2].flags |= TILE_MISMATCH_UP;
-          printf("UD mismatch %3d,%3d : {%2d,%2d,%2d,%2d}, {%2d,%2d,%2d,%2d}\n", group, groups[i+mapw], cv5[group].group.edge.left, cv5[group].group.edge.up, cv5[group].group.edge.right, cv5[group].group.edge.down, cv5[groups[i+mapw]].group.edge.left, cv5[groups[i+mapw]].group.edge.up, cv5[groups[i+mapw]].group.edge.right, cv5[groups[i+mapw]].group.edge.down);
-        }*/
       }
       
-      // get valid mismatch flags
-      mismatchMask = 0;
-      if(x > 0) mismatchMask |= TILE_MISMATCH_LEFT;
-      if(y > 0) mismatchMask |= TILE_MISMATCH_UP;
-      if(x < mapw-1) mismatchMask |= TILE_MISMATCH_RIGHT;
-      if(y < maph-1) mismatchMask |= TILE_MISMATCH_DOWN;
+      inRow = (w*64+64 <= ctx->mapw) ? ~(u64)0 : ((u64)1 << (ctx->mapw - w*64)) - 1;
+      hasLeft = (w == 0) ? inRow & ~(u64)1 : inRow;
+      hasRight = (w*64+64 < ctx->mapw) ? inRow : inRow >> 1;
+      valid = inRow & ~invalid;
+      
+      // pass 2: set neighbor flags, 64 tiles at a time
+      // (alignment flags probably not useful since grid domains account for this? TILE_VERT_MISALIGN?)
+      mismatchRight = valid & hasRight & ~pairs;
+      mismatchLeft = (mismatchRight << 1) | carry;
+      carry = mismatchRight >> 63;
+      
+      /*if(ctx->groups[i] == 0 || ctx->groups[i+ctx->mapw] == 0 || !isValidISOMPair(group, ctx->groups[i+ctx->mapw], DOWN)){
+        ctx->tileDoms[domIndex].flags |= TILE_MISMATCH_DOWN;
+        ctx->tileDoms[domIndex+ctx->mapw+2].flags |= TILE_MISMATCH_UP;
+      }*/
+      
+      // all valid neighbors are mismatched
+      allMismatched = ~(mismatchLeft ^ hasLeft) & ~(mismatchRight ^ hasRight)
+                    & ~(TilePlane(PLANE_MISMATCH_UP,y)[w] ^ (y > 0 ? ~(u64)0 : 0))
+                    & ~(TilePlane(PLANE_MISMATCH_DOWN,y)[w] ^ (y < ctx->maph-1 ? ~(u64)0 : 0));
       
       // no matching neighbors; not a valid tile
-      if((tileDoms[domIndex].flags & TILE_MISMATCHED) == mismatchMask || // all valid neighbors are mismatched
-         (tileDoms[domIndex].flags & (TILE_COLUMN | TILE_BASIC_GROUP | TILE_MISMATCH_RIGHT)) == (TILE_LEFT_TILE | TILE_MISMATCH_RIGHT) || // left tile does not match right tile (unless a basic tile)
-         (tileDoms[domIndex].flags & (TILE_COLUMN | TILE_BASIC_GROUP | TILE_MISMATCH_LEFT)) == (TILE_RIGHT_TILE | TILE_MISMATCH_LEFT)) // right tile does not match left tile (unless a basic tile)
-      {
-        tileDoms[domIndex].flags |= TILE_INVALID_ISOM;
-      }
+      invalid |= valid & (allMismatched
+                        | (~column & ~basic & mismatchRight)  // left tile does not match right tile (unless a basic tile)
+                        | (column & ~basic & mismatchLeft));  // right tile does not match left tile (unless a basic tile)
       
-      /*
-      // can shift
-      if(x < 2 || groups[i-2] == 0 || isValidISOMPair(group, groups[i-2], LEFT)){
-        tileDoms[domIndex].flags |= TILE_CAN_SHIFT_LEFT;
-      }
-      if(x >= mapw-2 || groups[i+2] == 0 || isValidISOMPair(group, groups[i+2], RIGHT)){
-        tileDoms[domIndex].flags |= TILE_CAN_SHIFT_RIGHT;
-      }
-      if(y < 2 || groups[i-2*mapw] == 0 || isValidISOMPair(group, groups[i-2*mapw], UP)){
-        tileDoms[domIndex].flags |= TILE_CAN_SHIFT_UP;
-      }
-      if(y >= maph-2 || groups[i+2*maph] == 0 || isValidISOMPair(group, groups[i+2*mapw], DOWN)){
-        tileDoms[domIndex].flags |= TILE_CAN_SHIFT_DOWN;
+      TilePlane(PLANE_COLUMN,y)[w] = column;
+      TilePlane(PLANE_BASIC_GROUP,y)[w] = basic;
+      TilePlane(PLANE_DOODAD_TILE,y)[w] = doodad;
+      TilePlane(PLANE_HORZ_MISALIGN,y)[w] = (column ^ 0xAAAAAAAAAAAAAAAAULL) & valid; // column doesn't match x
+      TilePlane(PLANE_INVALID_ISOM,y)[w] = invalid;
+      TilePlane(PLANE_MISMATCH_LEFT,y)[w] = mismatchLeft & inRow;
+      TilePlane(PLANE_MISMATCH_RIGHT,y)[w] = mismatchRight;
+      
+      for(b = 0; b < 64; b++){
+        if(((mismatchRight >> b) & 1) == 0) continue;
+        x = w*64 + b;
+        i = y*ctx->mapw + x;
+        logDebug(LOG_TILES, "(%3d,%3d) LR mismatch %3d,%3d : {%2d,%2d,%2d,%2d}, {%2d,%2d,%2d,%2d}\n", x,y, ctx->groups[i], ctx->groups[i+1],
+                 EdgePlane(SIDE_LEFT)[i], EdgePlane(SIDE_UP)[i], EdgePlane(SIDE_RIGHT)[i], EdgePlane(SIDE_DOWN)[i],
+                 EdgePlane(SIDE_LEFT)[i+1], EdgePlane(SIDE_UP)[i+1], EdgePlane(SIDE_RIGHT)[i+1], EdgePlane(SIDE_DOWN)[i+1]);
       }
-      */
+    }
+    
+    // copy back to the per-tile flags
+    for(x = 0; x < ctx->mapw; x++){
+      ctx->tileDoms[DomCoords(x,y)].flags |= getTilePlaneFlags(ctx, x, y);
     }
   }
 }
 
 
-bool validateTILE(){
+bool validateTILE(ISOMContext* ctx){
   u32 x,y;
-  for(y = 0; y < maph; y++){
-    for(x = 0; x < mapw; x++){
-      if(groups[y*mapw + x] != getCV5Index(getTILETile(x,y))){
+  for(y = 0; y < ctx->maph; y++){
+    for(x = 0; x < ctx->mapw; x++){
+      if(ctx->groups[y*ctx->mapw + x] != getCV5Index(ctx, getTILETile(x,y))){
         return false;
       }
     }
@@ -471,13 +990,34 @@ bool validateTILE(){
 }
 
 
-bool validateISOM(u32* cellsChecked, u32* cellsValid){
+bool validateISOM(ISOMContext* ctx, u32* cellsChecked, u32* cellsValid){
   if(!hasISOMData()) return false;
   
+  ISOMBand* bands;
+  u32 count, i;
+  u32 validISOM = 0;
+  u32 checkISOM = 0;
+  
+  splitISOMPlanes(ctx->isom, (ctx->mapw/2+1)*(ctx->maph+1), ctx->isomTypes, ctx->isomDirs);
+  count = runISOMBands(ctx, validateISOMBand, NULL, -1, ctx->maph, &bands);
+  if(count == 0) return false;
+  for(i = 0; i < count; i++){
+    checkISOM += bands[i].cellsChecked;
+    validISOM += bands[i].cellsValid;
+  }
+  free(bands);
+  
+  logInfo(LOG_TILES, "Valid: %d of %d\n", validISOM, checkISOM);
+  if(cellsChecked != NULL) *cellsChecked = checkISOM;
+  if(cellsValid != NULL) *cellsValid = validISOM;
+  return validISOM == checkISOM;
+}
+
+// with a flag as the band's arg, stops at the first mismatch and skips the diagnostics
+void validateISOMBand(ISOMContext* ctx, ISOMBand* band){
   s32 x,y;
   s32 isomIndex;
   s32 tileIndex;
-  s32 domIndex;
   u32 id;
   u32 i,j;
   u32 cmpType;
@@ -485,144 +1025,230 @@ bool validateISOM(u32* cellsChecked, u32* cellsValid){
   bool isValid;
   u32 validISOM = 0;
   u32 checkISOM = 0;
+  volatile u32* failed = band->arg; // set for an early exit on the first mismatch, shared between bands
   
-  for(y = -1; y < maph; y++){
-    for(x = -2; x < mapw; x += 2){
-      tileIndex = y*mapw + x;
-      domIndex = DomCoords(x,y);
+  for(y = band->y0; y < band->y1 && (failed == NULL || *failed == 0); y++){
+    for(x = -2; x < ctx->mapw; x += 2){
+      tileIndex = y*ctx->mapw + x;
       
-      if(isISOMCellAt(x,y) || isEmptyISOMCellAt(x,y)){
+      if(isISOMCellAt(ctx, x,y) || isEmptyISOMCellAt(ctx, x,y)){
         checkISOM++;
-        id = getISOMTypeAt(x, y);
+        id = getISOMTypeAt(ctx, x, y);
         
         if(x < 0){
-          if(y < 0) cmpType = isom[ISOMCoords(x+2,y+1)].left.type;
-          else cmpType = isom[ISOMCoords(x+2,y)].left.type;
+          if(y < 0) cmpType = ISOMType(ISOMCoords(x+2,y+1), SIDE_LEFT);
+          else cmpType = ISOMType(ISOMCoords(x+2,y), SIDE_LEFT);
         }else{
-          if(y < 0) cmpType = isom[ISOMCoords(x,y+1)].right.type;
-          else cmpType = isom[ISOMCoords(x,y)].right.type;
+          if(y < 0) cmpType = ISOMType(ISOMCoords(x,y+1), SIDE_RIGHT);
+          else cmpType = ISOMType(ISOMCoords(x,y), SIDE_RIGHT);
         }
         
-        isValid = doesISOMCellEqualType(x,y, id);
-        if(!isValid){
-          if(y < 0){
-            if(x < 0){
-              isValid = isISOMPartialEdge(x,y, id, DOWN_RIGHT);
-            }else if(x >= mapw-2){
-              isValid = isISOMPartialEdge(x,y, id, DOWN_LEFT);
-            }else{
-              isValid = isISOMPartialEdge(x,y, id, DOWN);
-            }
-          }else if(y >= maph-1){
-            if(x < 0){
-              isValid = isISOMPartialEdge(x,y, id, UP_RIGHT);
-            }else if(x >= mapw-2){
-              isValid = isISOMPartialEdge(x,y, id, UP_LEFT);
-            }else{
-              isValid = isISOMPartialEdge(x,y, id, UP);
-            }
-          }else{
-            if(x < 0){
-              isValid = isISOMPartialEdge(x,y, id, RIGHT);
-            }else if(x >= mapw-2){
-              isValid = isISOMPartialEdge(x,y, id, LEFT);
-            }
-          }
-        }
+        isValid = isISOMCellValid(ctx, x,y, id);
         if(isValid){
           validISOM++;
+        }else if(failed != NULL){
+          *failed = 1;
+          break;
         }else{
           j = 0;
           for(i = 0; i < MAX_TABLE_COUNT; i++){
             //if(ISOMTypes[i] <= cmpType && ISOMTypes[i] > ISOMTypes[j]) j = i;
-            if(TerrainTypes[i].ISOMType <= cmpType && TerrainTypes[i].ISOMType > TerrainTypes[j].ISOMType) j = i;
+            if(ctx->TerrainTypes[i].ISOMType <= cmpType && ctx->TerrainTypes[i].ISOMType > ctx->TerrainTypes[j].ISOMType) j = i;
           }
-          printf("(%3d,%3d) %03x (actual: %03x): %3d, %3d; %3d, %3d\t\t%03x + %d\n", x,y, id, cmpType, (y<0||x<0)?0: groups[tileIndex], (y<0||x>=mapw-2)?0: groups[tileIndex+2], (y>=maph-1||x<0)?0: groups[tileIndex+mapw], (y>=mapw-1||x>=mapw-2)?0: groups[tileIndex+mapw+2], TerrainTypes[j].ISOMType, cmpType-TerrainTypes[j].ISOMType);
+          logDebug(LOG_CELLS, "(%3d,%3d) %03x (actual: %03x): %3d, %3d; %3d, %3d\t\t%03x + %d\n", x,y, id, cmpType, (y<0||x<0)?0: ctx->groups[tileIndex], (y<0||x>=ctx->mapw-2)?0: ctx->groups[tileIndex+2], (y>=ctx->maph-1||x<0)?0: ctx->groups[tileIndex+ctx->mapw], (y>=ctx->mapw-1||x>=ctx->mapw-2)?0: ctx->groups[tileIndex+ctx->mapw+2], ctx->TerrainTypes[j].ISOMType, cmpType-ctx->TerrainTypes[j].ISOMType);
           if(y >= 0){
-            if(x >= 0){
-              tileDoms[domIndex].flags |= TILE_MISMATCHED;
-              tileDoms[domIndex+1].flags |= TILE_MISMATCHED;
-            }
-            if(x < mapw-2){
-              tileDoms[domIndex+2].flags |= TILE_MISMATCHED;
-              tileDoms[domIndex+3].flags |= TILE_MISMATCHED;
-            }
+            if(x >= 0) markTileDoms(ctx, band, x, y, 2, TILE_MISMATCHED);
+            if(x < ctx->mapw-2) markTileDoms(ctx, band, x+2, y, 2, TILE_MISMATCHED);
           }
-          if(y < maph-1){
-            if(x >= 0){
-              tileDoms[domIndex+mapw+2].flags |= TILE_MISMATCHED;
-              tileDoms[domIndex+mapw+2+1].flags |= TILE_MISMATCHED;
-            }
-            if(x < mapw-2){
-              tileDoms[domIndex+mapw+2+2].flags |= TILE_MISMATCHED;
-              tileDoms[domIndex+mapw+2+3].flags |= TILE_MISMATCHED;
-            }
+          if(y < ctx->maph-1){
+            if(x >= 0) markTileDoms(ctx, band, x, y+1, 2, TILE_MISMATCHED);
+            if(x < ctx->mapw-2) markTileDoms(ctx, band, x+2, y+1, 2, TILE_MISMATCHED);
           }
         }
       }
     }
   }
   
-  printf("Valid: %d of %d\n", validISOM, checkISOM);
-  if(cellsChecked != NULL) *cellsChecked = checkISOM;
-  if(cellsValid != NULL) *cellsValid = validISOM;
-  return validISOM == checkISOM;
+  band->cellsChecked = checkISOM;
+  band->cellsValid = validISOM;
+}
+
+
+// a cell's type is valid if all of its values match it, or if it's a map border cell that
+// matches it as a partial edge
+bool isISOMCellValid(ISOMContext* ctx, s32 x, s32 y, u32 id){
+  if(doesISOMCellEqualType(ctx, x,y, id)) return true;
+  
+  if(y < 0){
+    if(x < 0) return isISOMPartialEdge(ctx, x,y, id, DOWN_RIGHT);
+    if(x >= ctx->mapw-2) return isISOMPartialEdge(ctx, x,y, id, DOWN_LEFT);
+    return isISOMPartialEdge(ctx, x,y, id, DOWN);
+  }
+  if(y >= ctx->maph-1){
+    if(x < 0) return isISOMPartialEdge(ctx, x,y, id, UP_RIGHT);
+    if(x >= ctx->mapw-2) return isISOMPartialEdge(ctx, x,y, id, UP_LEFT);
+    return isISOMPartialEdge(ctx, x,y, id, UP);
+  }
+  if(x < 0) return isISOMPartialEdge(ctx, x,y, id, RIGHT);
+  if(x >= ctx->mapw-2) return isISOMPartialEdge(ctx, x,y, id, LEFT);
+  return false;
+}
+
+
+// checks the map's ISOM data with none of initISOMData's shading or diagnostics,
+// stopping at the first cell that doesn't match
+bool verifyISOMData(ISOMContext* ctx){
+  ISOMBand* bands;
+  u32 count, i;
+  u32 checked = 0;
+  volatile u32 failed = 0;
+  
+  if(!hasISOMData() || loadISOMInputs(ctx, true) == false) return false;
+  
+  count = runISOMBands(ctx, parseTileGroupsBand, NULL, 0, ctx->maph, &bands);
+  if(count == 0) return false;
+  free(bands);
+  
+  splitISOMPlanes(ctx->isom, (ctx->mapw/2+1)*(ctx->maph+1), ctx->isomTypes, ctx->isomDirs);
+  count = runISOMBands(ctx, validateISOMBand, (void*)&failed, -1, ctx->maph, &bands);
+  if(count == 0) return false;
+  for(i = 0; i < count; i++){
+    checked += bands[i].cellsChecked;
+  }
+  free(bands);
+  
+  logFlush();
+  return failed == 0 && checked != 0;
 }
 
 
+// group, edges and checkISOMTiles flags of a single tile, like readTileGroups and parseTileGroupsBand
+// (basic runs are set to 0, so getISOMTypeAt always takes the full path) -- writes everything the
+// cell checks read, since sampling doesn't clear the buffers first
+void readTileAt(ISOMContext* ctx, s32 x, s32 y){
+  u32 i = y*ctx->mapw + x;
+  u32 group = ctx->ts->tileGroups[ctx->maptiles[i]];
+  const HotGroup* hot = &ctx->hotGroups[group];
+  
+  ctx->groups[i] = group;
+  EdgePlane(SIDE_LEFT)[i] = hot->edge[SIDE_LEFT];
+  EdgePlane(SIDE_UP)[i] = hot->edge[SIDE_UP];
+  EdgePlane(SIDE_RIGHT)[i] = hot->edge[SIDE_RIGHT];
+  EdgePlane(SIDE_DOWN)[i] = hot->edge[SIDE_DOWN];
+  ctx->basicRuns[i] = 0;
+  if(group != 0 && hot->id != 0){
+    ctx->tileDoms[DomCoords(x,y)].flags = (group & TILE_COLUMN) | (isBasicGroup(ctx, group) ? TILE_BASIC_GROUP : 0);
+  }else{
+    ctx->tileDoms[DomCoords(x,y)].flags = 0;
+  }
+}
+
+// reads only what validating the cell at x,y needs -- its 4x2 tiles and the 4 ISOM rects around it
+void readISOMCellInputs(ISOMContext* ctx, s32 x, s32 y){
+  s32 i,j;
+  s32 cols = ctx->mapw/2+1;
+  
+  for(j = y; j <= y+1; j++){
+    if(j < 0 || j >= ctx->maph) continue;
+    for(i = x; i < x+4; i++){
+      if(i >= 0 && i < ctx->mapw) readTileAt(ctx, i, j);
+    }
+  }
+  for(j = y; j <= y+1; j++){
+    if(j < 0 || j > ctx->maph) continue;
+    for(i = x/2; i <= x/2+1; i++){
+      if(i >= 0 && i < cols) splitISOMPlanes(&ctx->isom[j*cols + i], 1, &ctx->isomTypes[(j*cols + i)*4], &ctx->isomDirs[(j*cols + i)*4]);
+    }
+  }
+}
+
+u32 nextSampleRandom(u32* state){
+  // xorshift32
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
 
-void generateISOMGrids(){
+// validates a sample of the map's cells instead of all of them, estimating the mismatch rate --
+// stratified samples pick one cell from each of `samples` equal slices of the grid, otherwise cells
+// are picked uniformly at random. Positions that turn out not to be cells are skipped.
+bool sampleISOMData(ISOMContext* ctx, u32 samples, bool stratified, u32 seed, ISOMSample* result){
   s32 x,y;
-  u32 type;
-  u32 i;
+  u32 s, k, id;
+  u32 cells, stratum;
+  u32 state = seed ? seed : 1;
+  double n, p, z2;
+  
+  memset(result, 0, sizeof(ISOMSample));
+  if(!hasISOMData() || loadISOMInputs(ctx, false) == false) return false; // clean maps never touch the whole grid
+  
+  cells = (ctx->mapw/2+1)*(ctx->maph+1);
+  if(samples > cells) samples = cells;
+  
+  for(s = 0; s < samples; s++){
+    if(stratified){
+      k = (u64)s*cells/samples;
+      stratum = (u64)(s+1)*cells/samples - k;
+      k += nextSampleRandom(&state) % stratum;
+    }else{
+      k = nextSampleRandom(&state) % cells;
+    }
+    x = (k % (ctx->mapw/2+1))*2 - 2;
+    y = k / (ctx->mapw/2+1) - 1;
+    
+    readISOMCellInputs(ctx, x, y);
+    if(!isISOMCellAt(ctx, x,y) && !isEmptyISOMCellAt(ctx, x,y)) continue;
+    result->checked++;
+    id = getISOMTypeAt(ctx, x, y);
+    if(!isISOMCellValid(ctx, x,y, id)){
+      result->mismatched++;
+      logDebug(LOG_CELLS, "(%3d,%3d) sampled cell mismatch, expected %03x\n", x,y, id);
+    }
+  }
   
-  //u32 gridCount[4] = {0};
-  u32 gridID;
-  s32 domIndex;
+  // Wilson score interval, 95% upper bound -- still meaningful when no mismatches were sampled
+  if(result->checked != 0){
+    n = result->checked;
+    p = result->mismatched / n;
+    z2 = SAMPLE_Z*SAMPLE_Z;
+    result->rate = p;
+    result->upper = (p + z2/(2*n) + SAMPLE_Z*sqrt(p*(1-p)/n + z2/(4*n*n))) / (1 + z2/n);
+  }
+  
+  logInfo(LOG_CELLS, "Sampled: %d of %d mismatched, estimated rate %.3f%% (95%% upper bound %.3f%%)\n",
+          result->mismatched, result->checked, result->rate*100, result->upper*100);
+  logFlush();
+  return true;
+}
+
+
+void generateISOMGrids(ISOMContext* ctx){
+  u32 i,j;
+  ISOMBand* bands;
+  u32 count;
   
-  u32 gridSet;
   u32 singleGrids = TILE_ISOM_GRID;
   u32 singleGridID;
   u8 hasGridSet[16] = {0};
   
-  for(y = -1; y < maph; y++){
-    for(x = -2; x < mapw; x++){
-      gridID = (4 - 2*(y&1) - x) & 3;
-      domIndex = DomCoords(x,y);
-      
-      type = getISOMTypeAt(x,y);
-      tileDoms[domIndex].isomType = type;
-      tileDoms[domIndex].domain = DOMAIN_NONE;
-      if(type != 0){
-        //gridCount[gridID]++;
-        for(i = 0; i < 4; i++){
-          if(x+i < mapw){
-            tileDoms[domIndex+i].flags |= TILE_ISOM_GRID_0 << gridID;
-            if(y < maph-1) tileDoms[domIndex+mapw+2+i].flags |= TILE_ISOM_GRID_0 << gridID;
-          }
-        }
-      }
-    }
-  }
+  count = runISOMBands(ctx, findISOMGridsBand, NULL, -1, ctx->maph, &bands);
+  if(count == 0) return;
+  free(bands);
   
-  for(y = 0; y < maph; y++){
-    for(x = 0; x < mapw; x++){
-      gridID = (4 - 2*(y&1) - x) & 3;
-      domIndex = DomCoords(x,y);
-      
-      gridSet = tileDoms[domIndex].flags & TILE_ISOM_GRID;
-      if((tileDoms[domIndex].flags & TILE_INVALID_ISOM) == 0){
-        singleGrids &= gridSet;
-        hasGridSet[gridSet / TILE_ISOM_GRID_0] = 1;
-      }
+  count = runISOMBands(ctx, countISOMGridsBand, NULL, 0, ctx->maph, &bands);
+  if(count == 0) return;
+  for(i = 0; i < count; i++){
+    singleGrids &= bands[i].singleGrids;
+    for(j = 0; j < 16; j++){
+      hasGridSet[j] |= bands[i].hasGridSet[j];
     }
   }
+  free(bands);
   
-  printf("%X, ", singleGrids / TILE_ISOM_GRID_0);
-  for(i = 0; i < 16; i++){
-    printf("%d", hasGridSet[i]);
-  }
-  puts("");
+  logDebug(LOG_GRIDS, "%X, %d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d\n", singleGrids / TILE_ISOM_GRID_0,
+           hasGridSet[0], hasGridSet[1], hasGridSet[2], hasGridSet[3], hasGridSet[4], hasGridSet[5], hasGridSet[6], hasGridSet[7],
+           hasGridSet[8], hasGridSet[9], hasGridSet[10], hasGridSet[11], hasGridSet[12], hasGridSet[13], hasGridSet[14], hasGridSet[15]);
   
   // if multiple grids exist then select only one -- preference is grid 0, grid 2, then whatever
   if(singleGrids & TILE_ISOM_GRID_0){
@@ -641,29 +1267,247 @@ void generateISOMGrids(){
   
   // if a single grid exists, then clear all others and set as a singular domain
   if(singleGrids){
-    printf("single grid: %d\n", singleGridID);
-    for(y = -1; y < maph; y++){
-      for(x = -2; x < mapw; x++){
-        gridID = (4 - 2*(y&1) - x) & 3;
-        domIndex = DomCoords(x,y);
-        
-        tileDoms[domIndex].flags &= singleGrids | ~TILE_ISOM_GRID; // clear all grid flags other than single grid
-        if(singleGridID == gridID){
-          tileDoms[domIndex].domain = 0;
+    logInfo(LOG_GRIDS, "single grid: %d\n", singleGridID);
+    count = runISOMBands(ctx, keepISOMGridBand, &singleGridID, -1, ctx->maph, &bands);
+    if(count == 0) return;
+    free(bands);
+    if(addDomain(ctx) == NULL) return;
+    ctx->domains[0].color.raw = SHADING_NO_SHADING;
+    ctx->domains[0].bounds.left = -2;
+    ctx->domains[0].bounds.up = -1;
+    ctx->domains[0].bounds.right = ctx->mapw;
+    ctx->domains[0].bounds.down = ctx->maph;
+    ctx->domains[0].flags = singleGrids | DOM_SINGLE_GRID;
+    return;
+  }
+  
+  // multiple domains
+  labelISOMDomains(ctx);
+}
+
+// appends an uninitialized domain, growing the array as needed
+Domain* addDomain(ISOMContext* ctx){
+  Domain* domains;
+  u32 capacity;
+  if(ctx->domainCount >= DOMAIN_NONE) return NULL;
+  if(ctx->domainCount == ctx->domainCapacity){
+    capacity = ctx->domainCapacity ? ctx->domainCapacity*2 : 16;
+    domains = realloc(ctx->domains, capacity*sizeof(Domain));
+    if(domains == NULL){
+      logError(LOG_GENERAL, "Could not allocate memory :(\n");
+      return NULL;
+    }
+    ctx->domains = domains;
+    ctx->domainCapacity = capacity;
+  }
+  return &ctx->domains[ctx->domainCount++];
+}
+
+u32 findDomainRoot(u32* parent, u32 i){
+  while(parent[i] != i){
+    parent[i] = parent[parent[i]]; // path halving
+    i = parent[i];
+  }
+  return i;
+}
+
+// grid preference when a domain could use more than one -- same order as the single grid case
+const u8 gridPreference[4] = {0, 2, 1, 3};
+
+// labels connected regions of valid tiles that share an ISOM grid, in one union-find pass,
+// then assigns each rect on its domain's grid to that domain
+void labelISOMDomains(ISOMContext* ctx){
+  s32 x,y,i,j;
+  u32 tile, root, other, n;
+  u32 tileCount = ctx->mapw*ctx->maph;
+  u32 gridID, gridFlag;
+  u32* parent = malloc(tileCount*sizeof(u32));
+  u16* label = malloc(tileCount*sizeof(u16));
+  u8* grids = malloc(tileCount);  // per root: grids shared by every member
+  Domain* dom;
+  s32 domIndex;
+  u16 flags;
+  
+  if(parent == NULL || label == NULL || grids == NULL){
+    logError(LOG_GENERAL, "Could not allocate memory :(\n");
+    if(parent != NULL) free(parent);
+    if(label != NULL) free(label);
+    if(grids != NULL) free(grids);
+    return;
+  }
+  
+  // union valid tiles with their left and up neighbors while they still share a grid
+  for(y = 0, tile = 0; y < ctx->maph; y++){
+    for(x = 0; x < ctx->mapw; x++, tile++){
+      flags = ctx->tileDoms[DomCoords(x,y)].flags;
+      parent[tile] = tile;
+      grids[tile] = (flags & TILE_INVALID_ISOM) ? 0 : (flags & TILE_ISOM_GRID) / TILE_ISOM_GRID_0;
+      if(grids[tile] == 0) continue;
+      
+      for(n = 0; n < 2; n++){
+        if(n == 0 && x == 0) continue;
+        if(n == 1 && y == 0) continue;
+        other = (n == 0) ? tile-1 : tile-ctx->mapw;
+        root = findDomainRoot(parent, tile);
+        other = findDomainRoot(parent, other);
+        if(root == other || (grids[root] & grids[other]) == 0) continue;
+        if(root < other){
+          parent[other] = root; // the earliest tile stays the root
+          grids[root] &= grids[other];
+        }else{
+          parent[root] = other;
+          grids[other] &= grids[root];
+        }
+      }
+    }
+  }
+  
+  // one domain per root
+  ctx->domainCount = 0;
+  for(y = 0, tile = 0; y < ctx->maph; y++){
+    for(x = 0; x < ctx->mapw; x++, tile++){
+      label[tile] = DOMAIN_NONE;
+      flags = ctx->tileDoms[DomCoords(x,y)].flags;
+      if((flags & TILE_INVALID_ISOM) || (flags & TILE_ISOM_GRID) == 0) continue;
+      
+      root = findDomainRoot(parent, tile);
+      if(root == tile){
+        dom = addDomain(ctx);
+        if(dom == NULL) continue;
+        for(n = 0; (grids[root] & (1 << gridPreference[n])) == 0; n++);
+        dom->flags = TILE_ISOM_GRID_0 << gridPreference[n];
+        dom->color.raw = SHADING_NO_SHADING;
+        dom->bounds.left = x;
+        dom->bounds.up = y;
+        dom->bounds.right = x+1;
+        dom->bounds.down = y+1;
+        label[tile] = ctx->domainCount-1;
+      }else{
+        label[tile] = label[root]; // roots always come first in raster order
+        if(label[tile] == DOMAIN_NONE) continue;
+        dom = &ctx->domains[label[tile]];
+        if(x < dom->bounds.left) dom->bounds.left = x;
+        if(x+1 > dom->bounds.right) dom->bounds.right = x+1;
+        dom->bounds.down = y+1;
+      }
+      
+      // only keep the domain's grid
+      ctx->tileDoms[DomCoords(x,y)].flags &= dom->flags | ~TILE_ISOM_GRID;
+      clearTilePlanes(ctx, x, y, TILE_ISOM_GRID & ~dom->flags);
+    }
+  }
+  logInfo(LOG_GRIDS, "%d grid domains\n", ctx->domainCount);
+  
+  // each rect belongs to the first domain on its grid among the tiles it covers
+  for(y = -1; y < ctx->maph; y++){
+    for(x = -2; x < ctx->mapw; x++){
+      gridID = (4 - 2*(y&1) - x) & 3;
+      gridFlag = TILE_ISOM_GRID_0 << gridID;
+      domIndex = DomCoords(x,y);
+      ctx->tileDoms[domIndex].domain = DOMAIN_NONE;
+      for(j = y; j < y+2 && ctx->tileDoms[domIndex].domain == DOMAIN_NONE; j++){
+        if(j < 0 || j >= ctx->maph) continue;
+        for(i = x; i < x+4; i++){
+          if(i < 0 || i >= ctx->mapw) continue;
+          tile = j*ctx->mapw + i;
+          if(label[tile] != DOMAIN_NONE && ctx->domains[label[tile]].flags == gridFlag){
+            ctx->tileDoms[domIndex].domain = label[tile];
+            break;
+          }
         }
       }
     }
-    domains[0].color.raw = SHADING_NO_SHADING;
-    domains[0].bounds.left = -2;
-    domains[0].bounds.up = -1;
-    domains[0].bounds.right = mapw;
-    domains[0].bounds.down = maph;
-    domains[0].flags = singleGrids | DOM_SINGLE_GRID;
-    domainCount = 1;
-    return;
   }
   
-  // multiple domains ???
+  free(parent);
+  free(label);
+  free(grids);
+}
+
+// gets the ISOM type of every rect and flags the tiles it covers with its grid
+void findISOMGridsBand(ISOMContext* ctx, ISOMBand* band){
+  s32 x,y;
+  u32 type;
+  u32 i;
+  u32 gridID;
+  s32 domIndex;
+  
+  for(y = band->y0; y < band->y1; y++){
+    for(x = -2; x < ctx->mapw; x++){
+      gridID = (4 - 2*(y&1) - x) & 3;
+      domIndex = DomCoords(x,y);
+      
+      type = getISOMTypeAt(ctx, x,y);
+      ctx->tileDoms[domIndex].isomType = type;
+      ctx->tileDoms[domIndex].domain = DOMAIN_NONE;
+      if(type != 0){
+        for(i = 0; i < 4; i++){
+          if(x+i < ctx->mapw){
+            markTileDoms(ctx, band, x+i, y, 1, TILE_ISOM_GRID_0 << gridID);
+            if(y < ctx->maph-1) markTileDoms(ctx, band, x+i, y+1, 1, TILE_ISOM_GRID_0 << gridID);
+          }
+        }
+      }
+    }
+  }
+}
+
+// collects the grids shared by every valid tile and which grid combinations exist
+void countISOMGridsBand(ISOMContext* ctx, ISOMBand* band){
+  s32 y;
+  u32 w,g,set;
+  u32 words = (ctx->mapw + 63) / 64;
+  u64 valid, tiles;
+  u64 grids[4];
+  
+  band->singleGrids = TILE_ISOM_GRID;
+  for(y = band->y0; y < band->y1; y++){
+    for(w = 0; w < words; w++){
+      valid = (w*64+64 <= ctx->mapw) ? ~(u64)0 : ((u64)1 << (ctx->mapw - w*64)) - 1;
+      valid &= ~TilePlane(PLANE_INVALID_ISOM,y)[w];
+      if(valid == 0) continue;
+      
+      for(g = 0; g < 4; g++){
+        grids[g] = TilePlane(PLANE_ISOM_GRID_0+g,y)[w];
+        if(valid & ~grids[g]) band->singleGrids &= ~(TILE_ISOM_GRID_0 << g); // a valid tile isn't on this grid
+      }
+      for(set = 0; set < 16; set++){
+        if(band->hasGridSet[set]) continue;
+        tiles = valid;
+        for(g = 0; g < 4; g++){
+          tiles &= (set & (1 << g)) ? grids[g] : ~grids[g];
+        }
+        if(tiles != 0) band->hasGridSet[set] = 1;
+      }
+    }
+  }
+}
+
+// clears all grid flags other than the single grid and assigns its rects to domain 0
+void keepISOMGridBand(ISOMContext* ctx, ISOMBand* band){
+  s32 x,y;
+  u32 gridID;
+  s32 domIndex;
+  u32 singleGridID = *(u32*)band->arg;
+  u32 singleGrids = TILE_ISOM_GRID_0 << singleGridID;
+  u32 g;
+  
+  for(y = band->y0; y < band->y1; y++){
+    if(y >= 0){
+      for(g = 0; g < 4; g++){
+        if(g != singleGridID) memset(TilePlane(PLANE_ISOM_GRID_0+g,y), 0, ctx->planeWords*sizeof(u64));
+      }
+    }
+    for(x = -2; x < ctx->mapw; x++){
+      gridID = (4 - 2*(y&1) - x) & 3;
+      domIndex = DomCoords(x,y);
+      
+      ctx->tileDoms[domIndex].flags &= singleGrids | ~TILE_ISOM_GRID; // clear all grid flags other than single grid
+      if(singleGridID == gridID){
+        ctx->tileDoms[domIndex].domain = 0;
+      }
+    }
+  }
 }
 
 
@@ -671,284 +1515,343 @@ void generateISOMGrids(){
 
 
 
-u32 getISOMTypeAt(s32 x, s32 y){
+u32 getISOMTypeAt(ISOMContext* ctx, s32 x, s32 y){
   u16 tiles[8] = {0};
   u16 flags[8] = {TILE_INVALID_ISOM, TILE_INVALID_ISOM, TILE_INVALID_ISOM, TILE_INVALID_ISOM,
                   TILE_INVALID_ISOM, TILE_INVALID_ISOM, TILE_INVALID_ISOM, TILE_INVALID_ISOM};
   s32 i;
   
   // rectangle fully out of bounds -- all tiles undefined
-  if(x < -3 || x >= mapw || y < -1 || y >= maph){
-    printf("out of bounds %d,%d -- %d,%d,%d,%d\n", x,y, x < -3 , x >= mapw , y < -1 , y >= maph);
+  if(x < -3 || x >= ctx->mapw || y < -1 || y >= ctx->maph){
+    logTrace(LOG_CELLS, "out of bounds %d,%d -- %d,%d,%d,%d\n", x,y, x < -3 , x >= ctx->mapw , y < -1 , y >= ctx->maph);
     return 0;
   }
   
+  s32 tileIndex = y*ctx->mapw + x;
+  u32 group;
+  
+  // window inside a run of one basic terrain on both rows -- checkISOMTiles and getRectISOMType
+  // would only realign the pairs and return that terrain's type
+  if(x >= 0 && x+3 < ctx->mapw && y >= 0 && y+1 < ctx->maph && ctx->basicRuns[tileIndex] >= 4 && ctx->basicRuns[tileIndex+ctx->mapw] >= 4){
+    group = ctx->groups[tileIndex] & ~TILE_COLUMN;
+    if(group == (ctx->groups[tileIndex+ctx->mapw] & ~TILE_COLUMN) && isBasicGroup(ctx, group)){
+      return ctx->TerrainTypes[ctx->hotGroups[group].id].ISOMType;
+    }
+  }
+  
   // check custom patterns ?
   
   
   
-  s32 tileIndex = y*mapw + x;
   s32 domIndex = DomCoords(x,y);
   //s32 isomIndex = ISOMCoords(x0,y0);
   
   // copy tiles
   for(i = 0; i < 4; i++){
     if(i+x < 0) continue;
-    if(i+x >= mapw) break;
+    if(i+x >= ctx->mapw) break;
     if(y >= 0){
-      tiles[i] = groups[tileIndex+i];
-      flags[i] = tileDoms[domIndex+i].flags;
+      tiles[i] = ctx->groups[tileIndex+i];
+      flags[i] = ctx->tileDoms[domIndex+i].flags;
     }
-    if(y+1 < maph){
-      tiles[4+i] = groups[tileIndex+mapw+i];
-      flags[4+i] = tileDoms[domIndex+mapw+2+i].flags;
+    if(y+1 < ctx->maph){
+      tiles[4+i] = ctx->groups[tileIndex+ctx->mapw+i];
+      flags[4+i] = ctx->tileDoms[domIndex+ctx->mapw+2+i].flags;
     }
   }
   
   // validate tiles
   if(checkISOMTiles(tiles, flags) == false){
-    puts("invalid ISOM tiles");
+    logTrace(LOG_CELLS, "invalid ISOM tiles\n");
     // invalid ISOM tiles
     return 0;
   }
   
   //printf("tiles: %4d %4d %4d %4d\n       %4d %4d %4d %4d\n", tiles[0], tiles[1], tiles[2], tiles[3], tiles[4], tiles[5], tiles[6], tiles[7]);
   
-  return getRectISOMType(tiles);
+  return getRectISOMType(ctx, tiles, x, y);
 }
 
 
 
-bool isISOMCellAt(s32 x, s32 y){
+bool isISOMCellAt(ISOMContext* ctx, s32 x, s32 y){
   s32 isomIndex = ISOMCoords(x,y);
   if(y >= 0){
     if(x >= 0){
-      if(isom[isomIndex].right.dir != DIR_TOP_LEFT_H) return false;
-      if(isom[isomIndex].down.dir != DIR_TOP_LEFT_V) return false;
+      if(ISOMDir(isomIndex, SIDE_RIGHT) != DIR_TOP_LEFT_H) return false;
+      if(ISOMDir(isomIndex, SIDE_DOWN) != DIR_TOP_LEFT_V) return false;
     }
-    if(x < mapw-2){
-      if(isom[isomIndex+1].left.dir != DIR_TOP_RIGHT_H) return false;
-      if(isom[isomIndex+1].down.dir != DIR_TOP_RIGHT_V) return false;
+    if(x < ctx->mapw-2){
+      if(ISOMDir(isomIndex+1, SIDE_LEFT) != DIR_TOP_RIGHT_H) return false;
+      if(ISOMDir(isomIndex+1, SIDE_DOWN) != DIR_TOP_RIGHT_V) return false;
     }
   }
-  if(y < maph-1){
+  if(y < ctx->maph-1){
     if(x >= 0){
-      if(isom[isomIndex+mapw/2+1].right.dir != DIR_BOT_LEFT_H) return false;
-      if(isom[isomIndex+mapw/2+1].up.dir != DIR_BOT_LEFT_V) return false;
+      if(ISOMDir(isomIndex+ctx->mapw/2+1, SIDE_RIGHT) != DIR_BOT_LEFT_H) return false;
+      if(ISOMDir(isomIndex+ctx->mapw/2+1, SIDE_UP) != DIR_BOT_LEFT_V) return false;
     }
-    if(x < mapw-2){
-      if(isom[isomIndex+mapw/2+2].left.dir != DIR_BOT_RIGHT_H) return false;
-      if(isom[isomIndex+mapw/2+2].up.dir != DIR_BOT_RIGHT_V) return false;
+    if(x < ctx->mapw-2){
+      if(ISOMDir(isomIndex+ctx->mapw/2+2, SIDE_LEFT) != DIR_BOT_RIGHT_H) return false;
+      if(ISOMDir(isomIndex+ctx->mapw/2+2, SIDE_UP) != DIR_BOT_RIGHT_V) return false;
     }
   }
   return true;
 }
 
-bool isEmptyISOMCellAt(s32 x, s32 y){
+bool isEmptyISOMCellAt(ISOMContext* ctx, s32 x, s32 y){
   s32 isomIndex = ISOMCoords(x,y);
   u32 isomType = 0;
   if(y >= 0){
     if(x >= 0){
-      if(isom[isomIndex].right.dir != 0) return false;
-      if(isom[isomIndex].down.dir != 0) return false;
-      if(isom[isomIndex].right.type != isom[isomIndex].down.type) return false;
-      isomType = isom[isomIndex].right.type;
+      if(ISOMDir(isomIndex, SIDE_RIGHT) != 0) return false;
+      if(ISOMDir(isomIndex, SIDE_DOWN) != 0) return false;
+      if(ISOMType(isomIndex, SIDE_RIGHT) != ISOMType(isomIndex, SIDE_DOWN)) return false;
+      isomType = ISOMType(isomIndex, SIDE_RIGHT);
     }
-    if(x < mapw-2){
-      if(isom[isomIndex+1].left.dir != 0) return false;
-      if(isom[isomIndex+1].down.dir != 0) return false;
-      if(isom[isomIndex+1].left.type != isom[isomIndex+1].down.type) return false;
-      if(isomType != 0 && isom[isomIndex+1].left.type != isomType) return false;
-      if(isomType == 0) isomType = isom[isomIndex+1].left.type;
+    if(x < ctx->mapw-2){
+      if(ISOMDir(isomIndex+1, SIDE_LEFT) != 0) return false;
+      if(ISOMDir(isomIndex+1, SIDE_DOWN) != 0) return false;
+      if(ISOMType(isomIndex+1, SIDE_LEFT) != ISOMType(isomIndex+1, SIDE_DOWN)) return false;
+      if(isomType != 0 && ISOMType(isomIndex+1, SIDE_LEFT) != isomType) return false;
+      if(isomType == 0) isomType = ISOMType(isomIndex+1, SIDE_LEFT);
     }
   }
-  if(y < maph-1){
+  if(y < ctx->maph-1){
     if(x >= 0){
-      if(isom[isomIndex+mapw/2+1].right.dir != 0) return false;
-      if(isom[isomIndex+mapw/2+1].up.dir != 0) return false;
-      if(isom[isomIndex+mapw/2+1].right.type != isom[isomIndex+mapw/2+1].up.type) return false;
-      if(isomType != 0 && isom[isomIndex+mapw/2+1].right.type != isomType) return false;
-      if(isomType == 0) isomType = isom[isomIndex+mapw/2+1].right.type;
+      if(ISOMDir(isomIndex+ctx->mapw/2+1, SIDE_RIGHT) != 0) return false;
+      if(ISOMDir(isomIndex+ctx->mapw/2+1, SIDE_UP) != 0) return false;
+      if(ISOMType(isomIndex+ctx->mapw/2+1, SIDE_RIGHT) != ISOMType(isomIndex+ctx->mapw/2+1, SIDE_UP)) return false;
+      if(isomType != 0 && ISOMType(isomIndex+ctx->mapw/2+1, SIDE_RIGHT) != isomType) return false;
+      if(isomType == 0) isomType = ISOMType(isomIndex+ctx->mapw/2+1, SIDE_RIGHT);
     }
-    if(x < mapw-2){
-      if(isom[isomIndex+mapw/2+2].left.dir != 0) return false;
-      if(isom[isomIndex+mapw/2+2].up.dir != 0) return false;
-      if(isom[isomIndex+mapw/2+2].left.type != isom[isomIndex+mapw/2+2].up.type) return false;
-      if(isomType != 0 && isom[isomIndex+mapw/2+2].left.type != isomType) return false;
-      if(isomType == 0) isomType = isom[isomIndex+mapw/2+2].left.type;
+    if(x < ctx->mapw-2){
+      if(ISOMDir(isomIndex+ctx->mapw/2+2, SIDE_LEFT) != 0) return false;
+      if(ISOMDir(isomIndex+ctx->mapw/2+2, SIDE_UP) != 0) return false;
+      if(ISOMType(isomIndex+ctx->mapw/2+2, SIDE_LEFT) != ISOMType(isomIndex+ctx->mapw/2+2, SIDE_UP)) return false;
+      if(isomType != 0 && ISOMType(isomIndex+ctx->mapw/2+2, SIDE_LEFT) != isomType) return false;
+      if(isomType == 0) isomType = ISOMType(isomIndex+ctx->mapw/2+2, SIDE_LEFT);
     }
   }
   return true;
 }
 
-bool doesISOMCellEqualType(s32 x, s32 y, u32 type){
+bool doesISOMCellEqualType(ISOMContext* ctx, s32 x, s32 y, u32 type){
   s32 isomIndex = ISOMCoords(x,y);
   if(y >= 0){
     if(x >= 0){
-      if(isom[isomIndex].right.type != type) return false;
-      if(isom[isomIndex].down.type != type) return false;
+      if(ISOMType(isomIndex, SIDE_RIGHT) != type) return false;
+      if(ISOMType(isomIndex, SIDE_DOWN) != type) return false;
     }
-    if(x < mapw-2){
-      if(isom[isomIndex+1].left.type != type) return false;
-      if(isom[isomIndex+1].down.type != type) return false;
+    if(x < ctx->mapw-2){
+      if(ISOMType(isomIndex+1, SIDE_LEFT) != type) return false;
+      if(ISOMType(isomIndex+1, SIDE_DOWN) != type) return false;
     }
   }
-  if(y < maph-1){
+  if(y < ctx->maph-1){
     if(x >= 0){
-      if(isom[isomIndex+mapw/2+1].right.type != type) return false;
-      if(isom[isomIndex+mapw/2+1].up.type != type) return false;
+      if(ISOMType(isomIndex+ctx->mapw/2+1, SIDE_RIGHT) != type) return false;
+      if(ISOMType(isomIndex+ctx->mapw/2+1, SIDE_UP) != type) return false;
     }
-    if(x < mapw-2){
-      if(isom[isomIndex+mapw/2+2].left.type != type) return false;
-      if(isom[isomIndex+mapw/2+2].up.type != type) return false;
+    if(x < ctx->mapw-2){
+      if(ISOMType(isomIndex+ctx->mapw/2+2, SIDE_LEFT) != type) return false;
+      if(ISOMType(isomIndex+ctx->mapw/2+2, SIDE_UP) != type) return false;
     }
   }
   return true;
 }
 
-bool isISOMPartialEdge(s32 x, s32 y, u32 type, u32 rectSide){
-  u32 i,j;
-  u16 edgeType = 0;
-  u32 patType;
+// returns the type shared by every in-bounds value of the cell, ISOM_CELL_MIXED if they differ,
+// or ISOM_CELL_NONE if the cell is entirely out of bounds
+u32 getISOMCellType(ISOMContext* ctx, s32 x, s32 y){
+  s32 isomIndex = ISOMCoords(x,y);
+  u32 type = ISOM_CELL_NONE;
+  u32 vals[8];
+  u32 i, count = 0;
   
-  for(i = 0; i < MAX_TABLE_COUNT; i++){
-    if(TerrainTypes[i].groupType == GROUP_BASIC && TerrainTypes[i].ISOMType == type){
-      edgeType = TerrainTypes[i].edgeA;
-      break;
+  if(y >= 0){
+    if(x >= 0){
+      vals[count++] = ctx->isom[isomIndex].right.type;
+      vals[count++] = ctx->isom[isomIndex].down.type;
+    }
+    if(x < ctx->mapw-2){
+      vals[count++] = ctx->isom[isomIndex+1].left.type;
+      vals[count++] = ctx->isom[isomIndex+1].down.type;
     }
   }
-  if(edgeType == 0) return false;
-  
-  for(i = 0; i < MAX_TABLE_COUNT; i++){
-    if(TerrainTypes[i].groupType <= GROUP_BASIC) continue; // skip basic types
-    patType = TerrainTypes[i].patternType;
-    if(TerrainTypes[i].edgeA != edgeType && (patType != PATTERN_TYPE_SIMPLE || TerrainTypes[i].edgeB != edgeType)) continue; // skip irrelevant edges
-    
-    for(j = 0; j < ISOM_EDGE_COUNT; j++){
-      switch(rectSide){
-        case LEFT:
-          if((ISOMPatterns[j].tileTypes[patType][PATTERN_TOP_LEFT] & GROUP_BASIC) && (ISOMPatterns[j].tileTypes[patType][PATTERN_BOT_LEFT] & GROUP_BASIC)){
-            if(doesISOMCellEqualType(x, y, TerrainTypes[i].ISOMType + j)) return true;
-          }
-          break;
-        case RIGHT:
-          if((ISOMPatterns[j].tileTypes[patType][PATTERN_TOP_RIGHT] & GROUP_BASIC) && (ISOMPatterns[j].tileTypes[patType][PATTERN_BOT_RIGHT] & GROUP_BASIC)){
-            if(doesISOMCellEqualType(x, y, TerrainTypes[i].ISOMType + j)) return true;
-          }
-          break;
-        case UP:
-          if((ISOMPatterns[j].tileTypes[patType][PATTERN_TOP_LEFT] & GROUP_BASIC) && (ISOMPatterns[j].tileTypes[patType][PATTERN_TOP_RIGHT] & GROUP_BASIC)){
-            if(doesISOMCellEqualType(x, y, TerrainTypes[i].ISOMType + j)) return true;
-          }
-          break;
-        case DOWN:
-          if((ISOMPatterns[j].tileTypes[patType][PATTERN_BOT_LEFT] & GROUP_BASIC) && (ISOMPatterns[j].tileTypes[patType][PATTERN_BOT_RIGHT] & GROUP_BASIC)){
-            if(doesISOMCellEqualType(x, y, TerrainTypes[i].ISOMType + j)) return true;
-          }
-          break;
-        case UP_LEFT:
-          if(ISOMPatterns[j].tileTypes[patType][PATTERN_TOP_LEFT] & GROUP_BASIC){
-            if(doesISOMCellEqualType(x, y, TerrainTypes[i].ISOMType + j)) return true;
-          }
-          break;
-        case UP_RIGHT:
-          if(ISOMPatterns[j].tileTypes[patType][PATTERN_TOP_RIGHT] & GROUP_BASIC){
-            if(doesISOMCellEqualType(x, y, TerrainTypes[i].ISOMType + j)) return true;
-          }
-          break;
-        case DOWN_LEFT:
-          if(ISOMPatterns[j].tileTypes[patType][PATTERN_BOT_LEFT] & GROUP_BASIC){
-            if(doesISOMCellEqualType(x, y, TerrainTypes[i].ISOMType + j)) return true;
-          }
-          break;
-        case DOWN_RIGHT:
-          if(ISOMPatterns[j].tileTypes[patType][PATTERN_BOT_RIGHT] & GROUP_BASIC){
-            if(doesISOMCellEqualType(x, y, TerrainTypes[i].ISOMType + j)) return true;
-          }
-          break;
-      }
+  if(y < ctx->maph-1){
+    if(x >= 0){
+      vals[count++] = ctx->isom[isomIndex+ctx->mapw/2+1].right.type;
+      vals[count++] = ctx->isom[isomIndex+ctx->mapw/2+1].up.type;
+    }
+    if(x < ctx->mapw-2){
+      vals[count++] = ctx->isom[isomIndex+ctx->mapw/2+2].left.type;
+      vals[count++] = ctx->isom[isomIndex+ctx->mapw/2+2].up.type;
     }
   }
   
-  return false;
+  if(count != 0) type = vals[0];
+  for(i = 1; i < count; i++){
+    if(vals[i] != type) return ISOM_CELL_MIXED;
+  }
+  return type;
 }
 
-bool isISOMPartialEdgeSimple(u32 baseType, u32 cmpType, u32 rectSide){
-  u32 i,j;
-  u16 edgeType = 0;
-  u32 patType;
-  
-  if(baseType == cmpType) return true;
-  
-  for(i = 0; i < MAX_TABLE_COUNT; i++){
-    if(TerrainTypes[i].groupType == GROUP_BASIC && TerrainTypes[i].ISOMType == baseType){
-      edgeType = TerrainTypes[i].edgeA;
-      break;
+// quadrants that must be basic terrain for each rect side
+const u8 sideQuadrants[8][2] = {
+  {PATTERN_TOP_LEFT,  PATTERN_BOT_LEFT},  // LEFT
+  {PATTERN_TOP_LEFT,  PATTERN_TOP_RIGHT}, // UP
+  {PATTERN_TOP_RIGHT, PATTERN_BOT_RIGHT}, // RIGHT
+  {PATTERN_BOT_LEFT,  PATTERN_BOT_RIGHT}, // DOWN
+  {PATTERN_TOP_LEFT,  PATTERN_TOP_LEFT},  // UP_LEFT
+  {PATTERN_TOP_RIGHT, PATTERN_TOP_RIGHT}, // UP_RIGHT
+  {PATTERN_BOT_LEFT,  PATTERN_BOT_LEFT},  // DOWN_LEFT
+  {PATTERN_BOT_RIGHT, PATTERN_BOT_RIGHT}  // DOWN_RIGHT
+};
+
+#define SET_TYPE_BIT(set,type)   ((set)[(type) >> 6] |= (u64)1 << ((type) & 63))
+#define TEST_TYPE_BIT(set,type)  (((set)[(type) >> 6] >> ((type) & 63)) & 1)
+
+// builds the partial edge type sets for every basic terrain from the current TerrainTypes
+// packs what classification reads from each cv5 group, so the working set stays in cache
+bool generateHotGroups(ISOMContext* ctx){
+  const CV5* cv5 = ctx->ts->cv5;
+  u32 count = ctx->ts->cv5count + 1; // checkISOMTiles can realign a group one past the end
+  u32 i, side;
+  u16 edges[4];
+  HotGroup* hot;
+  const TerrainType* type;
+  
+  if(count > ctx->hotGroupCapacity){
+    hot = realloc(ctx->hotGroups, count*sizeof(HotGroup));
+    if(hot == NULL){
+      logError(LOG_GENERAL, "Could not allocate memory :(\n");
+      return false;
     }
+    ctx->hotGroups = hot;
+    ctx->hotGroupCapacity = count;
   }
-  if(edgeType == 0) return false;
+  memset(ctx->hotGroups, 0, count*sizeof(HotGroup));
+  
+  for(i = 0; i < ctx->ts->cv5count; i++){
+    hot = &ctx->hotGroups[i];
+    hot->id = cv5[i].id;
+    edges[SIDE_LEFT] = cv5[i].group.edge.left;
+    edges[SIDE_UP] = cv5[i].group.edge.up;
+    edges[SIDE_RIGHT] = cv5[i].group.edge.right;
+    edges[SIDE_DOWN] = cv5[i].group.edge.down;
+    for(side = 0; side < 4; side++){
+      hot->edge[side] = edges[side] > 0xFF ? 0xFF : edges[side]; // real edge IDs are all below EDGE_RSV_START+8
+    }
+    if(i & TILE_COLUMN) hot->flags |= HOT_RIGHT_TILE;
+    if(cv5[i].id >= MAX_TABLE_COUNT) continue;
+    
+    type = &ctx->TerrainTypes[cv5[i].id];
+    hot->flags |= type->groupType & GROUP_ANY;
+    if(type->groupType == GROUP_STACK && i >= type->firstGroup && i < type->lastGroup) hot->flags |= HOT_STACK_RANGE;
+  }
+  return true;
+}
+
+void generatePartialEdgeSets(ISOMContext* ctx){
+  PartialEdgeSets* sets = ctx->partialEdges;
+  const u8* quads;
+  u32 b,i,j,side;
+  u16 edgeType;
+  u32 patType, type;
   
-  for(i = 0; i < MAX_TABLE_COUNT; i++){
-    if(TerrainTypes[i].groupType <= GROUP_BASIC) continue; // skip basic types
-    patType = TerrainTypes[i].patternType;
-    if(TerrainTypes[i].edgeA != edgeType && (patType != PATTERN_TYPE_SIMPLE || TerrainTypes[i].edgeB != edgeType)) continue; // skip irrelevant edges
+  memset(sets, 0, sizeof(PartialEdgeSets));
+  memset(sets->basicTerrain, BASIC_TYPE_NONE, sizeof(sets->basicTerrain));
+  
+  for(b = 0; b < MAX_TABLE_COUNT; b++){
+    if(ctx->TerrainTypes[b].groupType != GROUP_BASIC || ctx->TerrainTypes[b].ISOMType >= ISOM_TYPE_COUNT) continue;
+    if(sets->basicTerrain[ctx->TerrainTypes[b].ISOMType] != BASIC_TYPE_NONE) continue; // first match wins
+    sets->basicTerrain[ctx->TerrainTypes[b].ISOMType] = b;
     
-    for(j = 0; j < ISOM_EDGE_COUNT; j++){
-      switch(rectSide){
-        case LEFT:
-          if((ISOMPatterns[j].tileTypes[patType][PATTERN_TOP_LEFT] & GROUP_BASIC) || (ISOMPatterns[j].tileTypes[patType][PATTERN_BOT_LEFT] & GROUP_BASIC)){
-            if(cmpType == TerrainTypes[i].ISOMType + j) return true;
-          }
-          break;
-        case RIGHT:
-          if((ISOMPatterns[j].tileTypes[patType][PATTERN_TOP_RIGHT] & GROUP_BASIC) || (ISOMPatterns[j].tileTypes[patType][PATTERN_BOT_RIGHT] & GROUP_BASIC)){
-            if(cmpType == TerrainTypes[i].ISOMType + j) return true;
-          }
-          break;
-        case UP:
-          if((ISOMPatterns[j].tileTypes[patType][PATTERN_TOP_LEFT] & GROUP_BASIC) || (ISOMPatterns[j].tileTypes[patType][PATTERN_TOP_RIGHT] & GROUP_BASIC)){
-            if(cmpType == TerrainTypes[i].ISOMType + j) return true;
+    edgeType = ctx->TerrainTypes[b].edgeA;
+    if(edgeType == 0) continue;
+    
+    for(i = 0; i < MAX_TABLE_COUNT; i++){
+      if(ctx->TerrainTypes[i].groupType <= GROUP_BASIC) continue; // skip basic types
+      patType = ctx->TerrainTypes[i].patternType;
+      if(ctx->TerrainTypes[i].edgeA != edgeType && (patType != PATTERN_TYPE_SIMPLE || ctx->TerrainTypes[i].edgeB != edgeType)) continue; // skip irrelevant edges
+      
+      for(j = 0; j < ISOM_EDGE_COUNT; j++){
+        type = ctx->TerrainTypes[i].ISOMType + j;
+        if(type >= ISOM_TYPE_COUNT) break;
+        for(side = 0; side < 8; side++){
+          quads = sideQuadrants[side];
+          if((ISOMPatterns[j].tileTypes[patType][quads[0]] & GROUP_BASIC) && (ISOMPatterns[j].tileTypes[patType][quads[1]] & GROUP_BASIC)){
+            SET_TYPE_BIT(sets->allOf[b][side], type);
           }
-          break;
-        case DOWN:
-          if((ISOMPatterns[j].tileTypes[patType][PATTERN_BOT_LEFT] & GROUP_BASIC) || (ISOMPatterns[j].tileTypes[patType][PATTERN_BOT_RIGHT] & GROUP_BASIC)){
-            if(cmpType == TerrainTypes[i].ISOMType + j) return true;
+          if(side < 4 && ((ISOMPatterns[j].tileTypes[patType][quads[0]] & GROUP_BASIC) || (ISOMPatterns[j].tileTypes[patType][quads[1]] & GROUP_BASIC))){
+            SET_TYPE_BIT(sets->anyOf[b][side], type);
           }
-          break;
+        }
       }
     }
   }
-  return false;
 }
 
-void setISOMCellAt(s32 x, s32 y, u32 type){
+bool isISOMPartialEdge(ISOMContext* ctx, s32 x, s32 y, u32 type, u32 rectSide){
+  const u64* set;
+  u32 b, cellType, i;
+  
+  if(type >= ISOM_TYPE_COUNT || rectSide >= 8) return false;
+  b = ctx->partialEdges->basicTerrain[type];
+  if(b == BASIC_TYPE_NONE) return false;
+  set = ctx->partialEdges->allOf[b][rectSide];
+  
+  cellType = getISOMCellType(ctx, x, y);
+  if(cellType == ISOM_CELL_MIXED) return false;
+  if(cellType == ISOM_CELL_NONE){
+    // nothing in bounds to compare, so any candidate matches
+    for(i = 0; i < ISOM_TYPE_WORDS; i++){
+      if(set[i] != 0) return true;
+    }
+    return false;
+  }
+  return TEST_TYPE_BIT(set, cellType);
+}
+
+bool isISOMPartialEdgeSimple(ISOMContext* ctx, u32 baseType, u32 cmpType, u32 rectSide){
+  u32 b;
+  
+  if(baseType == cmpType) return true;
+  if(baseType >= ISOM_TYPE_COUNT || cmpType >= ISOM_TYPE_COUNT || rectSide >= 4) return false;
+  b = ctx->partialEdges->basicTerrain[baseType];
+  if(b == BASIC_TYPE_NONE) return false;
+  return TEST_TYPE_BIT(ctx->partialEdges->anyOf[b][rectSide], cmpType);
+}
+
+void setISOMCellAt(ISOMContext* ctx, s32 x, s32 y, u32 type){
   s32 isomIndex = ISOMCoords(x,y);
   if(y >= 0){
     if(x >= 0){
-      isom[isomIndex].right.dir = DIR_TOP_LEFT_H;
-      isom[isomIndex].right.type = type;
-      isom[isomIndex].down.dir = DIR_TOP_LEFT_V;
-      isom[isomIndex].down.type = type;
+      ctx->isom[isomIndex].right.dir = DIR_TOP_LEFT_H;
+      ctx->isom[isomIndex].right.type = type;
+      ctx->isom[isomIndex].down.dir = DIR_TOP_LEFT_V;
+      ctx->isom[isomIndex].down.type = type;
     }
-    if(x < mapw){
-      isom[isomIndex+1].left.dir = DIR_TOP_RIGHT_H;
-      isom[isomIndex+1].left.type = type;
-      isom[isomIndex+1].down.dir = DIR_TOP_RIGHT_V;
-      isom[isomIndex+1].down.type = type;
+    if(x < ctx->mapw){
+      ctx->isom[isomIndex+1].left.dir = DIR_TOP_RIGHT_H;
+      ctx->isom[isomIndex+1].left.type = type;
+      ctx->isom[isomIndex+1].down.dir = DIR_TOP_RIGHT_V;
+      ctx->isom[isomIndex+1].down.type = type;
     }
   }
-  if(y < maph){
+  if(y < ctx->maph){
     if(x >= 0){
-      isom[isomIndex+mapw/2+1].right.dir = DIR_BOT_LEFT_H;
-      isom[isomIndex+mapw/2+1].right.type = type;
-      isom[isomIndex+mapw/2+1].up.dir = DIR_BOT_LEFT_V;
-      isom[isomIndex+mapw/2+1].up.type = type;
+      ctx->isom[isomIndex+ctx->mapw/2+1].right.dir = DIR_BOT_LEFT_H;
+      ctx->isom[isomIndex+ctx->mapw/2+1].right.type = type;
+      ctx->isom[isomIndex+ctx->mapw/2+1].up.dir = DIR_BOT_LEFT_V;
+      ctx->isom[isomIndex+ctx->mapw/2+1].up.type = type;
     }
-    if(x < mapw){
-      isom[isomIndex+mapw/2+2].left.dir = DIR_BOT_RIGHT_H;
-      isom[isomIndex+mapw/2+2].left.type = type;
-      isom[isomIndex+mapw/2+2].up.dir = DIR_BOT_RIGHT_V;
-      isom[isomIndex+mapw/2+2].up.type = type;
+    if(x < ctx->mapw){
+      ctx->isom[isomIndex+ctx->mapw/2+2].left.dir = DIR_BOT_RIGHT_H;
+      ctx->isom[isomIndex+ctx->mapw/2+2].left.type = type;
+      ctx->isom[isomIndex+ctx->mapw/2+2].up.dir = DIR_BOT_RIGHT_V;
+      ctx->isom[isomIndex+ctx->mapw/2+2].up.type = type;
     }
   }
 }
@@ -969,7 +1872,7 @@ bool checkISOMTiles(u16 tiles[], u16 flags[]){
     if(tiles[i] != 0) break;
   }
   if(i == 8){
-    printf("all tiles are undefined; ");
+    logTrace(LOG_CELLS, "all tiles are undefined; ");
     return false;
   }
   
@@ -990,12 +1893,12 @@ bool checkISOMTiles(u16 tiles[], u16 flags[]){
         tiles[i^1] = tiles[i] ^ TILE_COLUMN;
       }
       if((tiles[i]^1) != tiles[i^1]){
-        printf("[%d]==%d && [%d]==%d; ", i, tiles[i], i^1, tiles[i^1]);
+        logTrace(LOG_CELLS, "[%d]==%d && [%d]==%d; ", i, tiles[i], i^1, tiles[i^1]);
         // invalid pair
         return false;
       }
     }else if(tiles[i] != 0){
-      printf("invalid nonzero tile %d (%04X); ", tiles[i], flags[i]);
+      logTrace(LOG_CELLS, "invalid nonzero tile %d (%04X); ", tiles[i], flags[i]);
       // invalid pair
       return false;
     }
@@ -1005,10 +1908,81 @@ bool checkISOMTiles(u16 tiles[], u16 flags[]){
 }
 
 
-u32 getRectISOMType(u16 tiles[]){
+// memoized front end for computeRectISOMType -- only the left tile of each pair affects the result
+u32 getRectISOMType(ISOMContext* ctx, u16 tiles[], s32 x, s32 y){
+  u32 edgeTypes[8];
+  u64 key = (u64)tiles[0] | ((u64)tiles[2] << 16) | ((u64)tiles[4] << 32) | ((u64)tiles[6] << 48);
+  u32 slot, i;
+  RectCacheEntry* entry;
+  
+  if(key == 0) return 0; // all tiles are null
+  
+  ctx->rectCacheLookups++;
+  slot = (u32)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+  for(i = 0; i < RECT_CACHE_PROBES; i++){
+    entry = &ctx->rectCache[(slot+i) & (RECT_CACHE_SIZE-1)];
+    if(entry->key == key){
+      ctx->rectCacheHits++;
+      return entry->type;
+    }
+    if(entry->key == 0) break;
+  }
+  if(i == RECT_CACHE_PROBES) i = 0; // probe range is full -- replace the first entry
+  
+  entry = &ctx->rectCache[(slot+i) & (RECT_CACHE_SIZE-1)];
+  entry->key = key;
+  getRectEdges(ctx, tiles, x, y, edgeTypes);
+  entry->type = computeRectISOMType(ctx, tiles, edgeTypes);
+  return entry->type;
+}
+
+// gets the edges facing into the rectangle at x,y from the edge planes --
+// tiles that checkISOMTiles filled in or realigned aren't the map's, so those come from their groups
+void getRectEdges(ISOMContext* ctx, const u16 tiles[], s32 x, s32 y, u32 edgeTypes[]){
+  const HotGroup* hot = ctx->hotGroups;
+  s32 tx, ty;
+  u32 k, i;
+  u16 sides[4];
+  
+  for(k = 0; k < 4; k++){
+    tx = x + (k & 1)*2;
+    ty = y + (k >> 1);
+    if(tx >= 0 && tx < ctx->mapw && ty >= 0 && ty < ctx->maph && ctx->groups[ty*ctx->mapw + tx] == tiles[k*2]){
+      i = ty*ctx->mapw + tx;
+      sides[SIDE_LEFT] = EdgePlane(SIDE_LEFT)[i];
+      sides[SIDE_UP] = EdgePlane(SIDE_UP)[i];
+      sides[SIDE_RIGHT] = EdgePlane(SIDE_RIGHT)[i];
+      sides[SIDE_DOWN] = EdgePlane(SIDE_DOWN)[i];
+    }else{
+      sides[SIDE_LEFT] = hot[tiles[k*2]].edge[SIDE_LEFT];
+      sides[SIDE_UP] = hot[tiles[k*2]].edge[SIDE_UP];
+      sides[SIDE_RIGHT] = hot[tiles[k*2]].edge[SIDE_RIGHT];
+      sides[SIDE_DOWN] = hot[tiles[k*2]].edge[SIDE_DOWN];
+    }
+    switch(k){
+      case 0:
+        edgeTypes[DIR_TOP_LEFT_V] = sides[SIDE_DOWN];
+        edgeTypes[DIR_TOP_LEFT_H] = sides[SIDE_RIGHT];
+        break;
+      case 1:
+        edgeTypes[DIR_TOP_RIGHT_H] = sides[SIDE_LEFT];
+        edgeTypes[DIR_TOP_RIGHT_V] = sides[SIDE_DOWN];
+        break;
+      case 2:
+        edgeTypes[DIR_BOT_LEFT_V] = sides[SIDE_UP];
+        edgeTypes[DIR_BOT_LEFT_H] = sides[SIDE_RIGHT];
+        break;
+      case 3:
+        edgeTypes[DIR_BOT_RIGHT_V] = sides[SIDE_UP];
+        edgeTypes[DIR_BOT_RIGHT_H] = sides[SIDE_LEFT];
+        break;
+    }
+  }
+}
+
+u32 computeRectISOMType(ISOMContext* ctx, u16 tiles[], const u32 edgeTypes[]){
   u32 id;
   u32 i,j,k;
-  u32 edgeTypes[8];
   
   u32 isomType = 0;
   u32 isomSubtype = 0;
@@ -1016,6 +1990,10 @@ u32 getRectISOMType(u16 tiles[]){
   u32 typeMask;
   s32 match;
   s32 bestMatch = -1;
+  u64 edgeBytes, edgeMask;
+  s32 edgeCount;
+  const u8* tileTypes;
+  const HotGroup* hot = ctx->hotGroups;
   
   // are all nonzero tiles the same ID?
   id = 0;
@@ -1029,86 +2007,81 @@ u32 getRectISOMType(u16 tiles[]){
     }
   }
   if(id == 0) return 0;
-  if(i == 8 && isBasicGroup(id)){ // all nonzero tiles are a basic group
-    return TerrainTypes[cv5[id].id].ISOMType;
+  if(i == 8 && isBasicGroup(ctx, id)){ // all nonzero tiles are a basic group
+    return ctx->TerrainTypes[hot[id].id].ISOMType;
   }
   
-  edgeTypes[DIR_TOP_LEFT_V] = cv5[tiles[0]].group.edge.down;
-  edgeTypes[DIR_BOT_LEFT_V] = cv5[tiles[4]].group.edge.up;
-  edgeTypes[DIR_TOP_LEFT_H] = cv5[tiles[0]].group.edge.right;
-  edgeTypes[DIR_TOP_RIGHT_H] = cv5[tiles[2]].group.edge.left;
-  edgeTypes[DIR_TOP_RIGHT_V] = cv5[tiles[2]].group.edge.down;
-  edgeTypes[DIR_BOT_RIGHT_V] = cv5[tiles[6]].group.edge.up;
-  edgeTypes[DIR_BOT_LEFT_H] = cv5[tiles[4]].group.edge.right;
-  edgeTypes[DIR_BOT_RIGHT_H] = cv5[tiles[6]].group.edge.left;
+  // the window's edges one per byte -- null edges match anything
+  edgeBytes = 0;
+  edgeMask = 0;
+  edgeCount = 0;
+  for(k = 0; k < 8; k++){
+    if(edgeTypes[k] == 0) continue;
+    edgeBytes |= (u64)edgeTypes[k] << (k*8);
+    edgeMask |= (u64)0xFF << (k*8);
+    edgeCount++;
+  }
   
   for(i = 0; i < ISOM_EDGE_COUNT; i++){
     for(j = 0; j < 4; j++){
-      id = cv5[tiles[ISOMPatterns[i].tileOrder[j]*2]].id;
-      if(id == 0 || TerrainTypes[id].groupType == GROUP_BASIC) continue; // not a transition type
-      patType = TerrainTypes[id].patternType;
+      id = hot[tiles[ISOMPatterns[i].tileOrder[j]*2]].id;
+      if(id == 0 || ctx->TerrainTypes[id].groupType == GROUP_BASIC) continue; // not a transition type
+      patType = ctx->TerrainTypes[id].patternType;
+      tileTypes = PatternFor(id,i)->tileTypes; // from the type's own pattern type, even if it turns out to be a stack
       
       // is top row *only* null and bottom row *only* cliff stacking tiles?
       if(patType == PATTERN_TYPE_STACK && tiles[0] == 0 && tiles[2] == 0){
         for(k = 4; k < 8; k+=2){ // use a loop with continues/breaks rather than a massive "if"
           if(tiles[k] == 0) continue; // null is valid
-          if(TerrainTypes[cv5[tiles[k]].id].groupType != GROUP_STACK) break;
-          if(tiles[k] < TerrainTypes[cv5[tiles[k]].id].firstGroup) break;
-          if(tiles[k] >= TerrainTypes[cv5[tiles[k]].id].lastGroup) break;
-          if(k == 6 && tiles[4] != 0 && cv5[tiles[4]].id != cv5[tiles[6]].id) break; // left and right tiles don't match -- this isn't a valid case
+          if((hot[tiles[k]].flags & HOT_STACK_RANGE) == 0) break;
+          if(k == 6 && tiles[4] != 0 && hot[tiles[4]].id != hot[tiles[6]].id) break; // left and right tiles don't match -- this isn't a valid case
         }
         if(k == 8){ // yes -- set id to the upper ID
           k = tiles[4] ? 4 : 6; // select whichever isn't null
-          id = TerrainTypes[cv5[tiles[k]].id].cliffUpper;
+          id = ctx->TerrainTypes[hot[tiles[k]].id].cliffUpper;
           //patType = PATTERN_TYPE_CLIFFS;
         }
       }
       
+      // do all non-null edges match?
+      if((edgeBytes ^ PatternFor(id,i)->edges) & edgeMask) continue;
+      
       // validate tile types
       for(k = 0; k < 4; k++){
         if(tiles[k*2] == 0) continue;
         
-        typeMask = TerrainTypes[cv5[tiles[k*2]].id].groupType;
+        typeMask = hot[tiles[k*2]].flags & GROUP_ANY;
         if(typeMask == GROUP_STACK){
           // if it's not inside the stack range then it's regular cliff tiles
-          if(TerrainTypes[cv5[tiles[k*2]].id].cliffUpper != id || tiles[k*2] < TerrainTypes[cv5[tiles[k*2]].id].firstGroup || tiles[k*2] >= TerrainTypes[cv5[tiles[k*2]].id].lastGroup){
+          if(ctx->TerrainTypes[hot[tiles[k*2]].id].cliffUpper != id || (hot[tiles[k*2]].flags & HOT_STACK_RANGE) == 0){
             typeMask = GROUP_EDGE;
           }
         }
         
-        typeMask &= ISOMPatterns[i].tileTypes[patType][k];
+        typeMask &= tileTypes[k];
         if(typeMask == 0) break;
-        if((ISOMPatterns[i].tileTypes[patType][k] & GROUP_BASIC) == 0){ // not basic and not "any"
+        if((tileTypes[k] & GROUP_BASIC) == 0){ // not basic and not "any"
           if(typeMask & GROUP_EDGE){
             // is it the same type of edge?
-            if(cv5[tiles[k*2]].id == id) continue;
+            if(hot[tiles[k*2]].id == id) continue;
           }
           if(typeMask & GROUP_STACK){
             // is it it the correct type of cliff?
-            if(TerrainTypes[cv5[tiles[k*2]].id].cliffUpper == id) continue;
+            if(ctx->TerrainTypes[hot[tiles[k*2]].id].cliffUpper == id) continue;
           }
           break;
         }
       }
       if(k != 4) continue;
       
-      
-      match = 0;
-      for(k = 0; k < 8; k++){
-        if(edgeTypes[k] == 0) continue;
-        if(edgeMatches(edgeTypes[k], ISOMPatterns[i].edges[k], id) == false){
-          break;
-        }
-        match++;
-      }
-      if(k != 8) continue;
+      match = edgeCount;
       if(match == 8){
-        return TerrainTypes[id].ISOMType + i;
+        return PatternFor(id,i)->ISOMType;
       }
       
       if(match > bestMatch){
         bestMatch = match;
-        isomType = TerrainTypes[id].ISOMType;
+        isomType = ctx->TerrainTypes[id].ISOMType;
         isomSubtype = i;
       }
     }
@@ -1127,12 +2100,12 @@ u32 getRectISOMType(u16 tiles[]){
   }
   if(id == 0) return 0; // all edges are 0
   if(i == 8){ // all edges are the same
-    i = getISOMFromBasicEdge(id);
+    i = getISOMFromBasicEdge(ctx, id);
     if(i != 0) return i;
   }
   
   if(isomType == 0){
-    printf("\t%03x (%d) egde IDs: %d,%d, %d,%d, %d,%d, %d,%d\n", isomType+isomSubtype, isomSubtype, edgeTypes[DIR_TOP_LEFT_V],edgeTypes[DIR_BOT_LEFT_V],edgeTypes[DIR_TOP_LEFT_H],edgeTypes[DIR_TOP_RIGHT_H],edgeTypes[DIR_TOP_RIGHT_V],edgeTypes[DIR_BOT_RIGHT_V],edgeTypes[DIR_BOT_LEFT_H],edgeTypes[DIR_BOT_RIGHT_H]);
+    logTrace(LOG_TYPES, "\t%03x (%d) egde IDs: %d,%d, %d,%d, %d,%d, %d,%d\n", isomType+isomSubtype, isomSubtype, edgeTypes[DIR_TOP_LEFT_V],edgeTypes[DIR_BOT_LEFT_V],edgeTypes[DIR_TOP_LEFT_H],edgeTypes[DIR_TOP_RIGHT_H],edgeTypes[DIR_TOP_RIGHT_V],edgeTypes[DIR_BOT_RIGHT_V],edgeTypes[DIR_BOT_LEFT_H],edgeTypes[DIR_BOT_RIGHT_H]);
   }
   
   return isomType+isomSubtype;
@@ -1140,64 +2113,149 @@ u32 getRectISOMType(u16 tiles[]){
 
 
 
-void generateTypeTables(){
+// copies TerrainTypes from the cache, or generates and caches them
+void loadTypeTables(ISOMContext* ctx){
+  u32 era = ctx->tileset & 7;
+  
+  AcquireSRWLockShared(&typeTableLock);
+  if(typeTableCache[era].valid && typeTableCache[era].cv5hash == ctx->ts->cv5hash){
+    memcpy(ctx->TerrainTypes, typeTableCache[era].types, sizeof(ctx->TerrainTypes));
+    ReleaseSRWLockShared(&typeTableLock);
+    return;
+  }
+  ReleaseSRWLockShared(&typeTableLock);
+  
+  generateTypeTables(ctx);
+  
+  AcquireSRWLockExclusive(&typeTableLock);
+  memcpy(typeTableCache[era].types, ctx->TerrainTypes, sizeof(ctx->TerrainTypes));
+  typeTableCache[era].cv5hash = ctx->ts->cv5hash;
+  typeTableCache[era].valid = true;
+  typeTableCacheDirty = true;
+  ReleaseSRWLockExclusive(&typeTableLock);
+}
+
+bool loadTypeTableCache(const char* path){
+  u32 size = 0;
+  u32 i;
+  u8* data;
+  TypeCacheHeader* header;
+  TypeCacheEntry* entries;
+  
+  if(!fileExists(path)) return false; // no cache yet
+  data = readFile(path, &size, FILE_DISK);
+  if(data == NULL) return false;
+  header = (TypeCacheHeader*)data;
+  entries = (TypeCacheEntry*)(data + sizeof(TypeCacheHeader));
+  // count is checked by division, so a corrupt count can't wrap the size
+  if(size < sizeof(TypeCacheHeader) || header->magic != TYPE_CACHE_MAGIC || header->version != TYPE_CACHE_VERSION ||
+     header->count > (size - sizeof(TypeCacheHeader)) / sizeof(TypeCacheEntry) ||
+     size != sizeof(TypeCacheHeader) + header->count*sizeof(TypeCacheEntry)){
+    logWarn(LOG_TYPES, "Invalid type table cache.\n");
+    free(data);
+    return false;
+  }
+  
+  AcquireSRWLockExclusive(&typeTableLock);
+  for(i = 0; i < header->count; i++){
+    if(entries[i].era >= 8) continue;
+    memcpy(typeTableCache[entries[i].era].types, entries[i].types, sizeof(entries[i].types));
+    typeTableCache[entries[i].era].cv5hash = entries[i].cv5hash;
+    typeTableCache[entries[i].era].valid = true;
+  }
+  typeTableCacheDirty = false;
+  ReleaseSRWLockExclusive(&typeTableLock);
+  
+  free(data);
+  return true;
+}
+
+// writes the cache only if new tables were generated since it was loaded
+bool saveTypeTableCache(const char* path){
+  u8 data[sizeof(TypeCacheHeader) + 8*sizeof(TypeCacheEntry)];
+  TypeCacheHeader* header = (TypeCacheHeader*)data;
+  TypeCacheEntry* entries = (TypeCacheEntry*)(data + sizeof(TypeCacheHeader));
+  u32 i;
+  bool result = true;
+  
+  AcquireSRWLockShared(&typeTableLock);
+  if(typeTableCacheDirty){
+    header->magic = TYPE_CACHE_MAGIC;
+    header->version = TYPE_CACHE_VERSION;
+    header->count = 0;
+    for(i = 0; i < 8; i++){
+      if(!typeTableCache[i].valid) continue;
+      entries[header->count].era = i;
+      entries[header->count].cv5hash = typeTableCache[i].cv5hash;
+      memcpy(entries[header->count].types, typeTableCache[i].types, sizeof(typeTableCache[i].types));
+      header->count++;
+    }
+    result = writeFile(path, data, sizeof(TypeCacheHeader) + header->count*sizeof(TypeCacheEntry), FILE_DISK);
+  }
+  ReleaseSRWLockShared(&typeTableLock);
+  
+  return result;
+}
+
+void generateTypeTables(ISOMContext* ctx){
   u32 i,j,k;
   u32 id;
   
   u8 typeMask;
   bool doingStackCliff;
+  const CV5* cv5 = ctx->ts->cv5;
   
-  memset(TerrainTypes, 0, sizeof(TerrainTypes));
+  memset(ctx->TerrainTypes, 0, sizeof(ctx->TerrainTypes));
   
   // pass 1: get edge types
-  for(i = 2; i < cv5count; i += 2){
+  for(i = 2; i < ctx->ts->cv5count; i += 2){
     id = cv5[i].id;
     if(id <= 1) continue;
     
     if(id >= MAX_TABLE_COUNT){
-      printf("wtf %d\n", id);
+      logWarn(LOG_TYPES, "wtf %d\n", id);
       continue;
     }
     
-    for(j = 0; CV5ISOMTypes[tileset][j].id != 0; j++){
-      if(CV5ISOMTypes[tileset][j].id == id){
-        TerrainTypes[id].ISOMType = CV5ISOMTypes[tileset][j].ISOM;
+    for(j = 0; CV5ISOMTypes[ctx->tileset][j].id != 0; j++){
+      if(CV5ISOMTypes[ctx->tileset][j].id == id){
+        ctx->TerrainTypes[id].ISOMType = CV5ISOMTypes[ctx->tileset][j].ISOM;
         break;
       }
     }
-    if(CV5ISOMTypes[tileset][j].id == 0){
-      printf("Unrecognized CV5 type %d at index %d\n", id, i);
+    if(CV5ISOMTypes[ctx->tileset][j].id == 0){
+      logWarn(LOG_TYPES, "Unrecognized CV5 type %d at index %d\n", id, i);
       continue;
     }
     
     // basic types
     if(cv5[i].group.edge.left == cv5[i].group.edge.up && cv5[i].group.edge.left == cv5[i].group.edge.right && cv5[i].group.edge.left == cv5[i].group.edge.down){
-      TerrainTypes[id].groupType = GROUP_BASIC;
-      TerrainTypes[id].edgeA = cv5[i].group.edge.left;
+      ctx->TerrainTypes[id].groupType = GROUP_BASIC;
+      ctx->TerrainTypes[id].edgeA = cv5[i].group.edge.left;
       continue;
     }
     
     // definitions can be split, most notably stacked cliffs
-    if(TerrainTypes[id].patternType != 0){
-      typeMask = TerrainTypes[id].patternType;
+    if(ctx->TerrainTypes[id].patternType != 0){
+      typeMask = ctx->TerrainTypes[id].patternType;
     }else{
       typeMask = SEL_ALL;
     }
     
-    for( ; i < cv5count && cv5[i].id == id; i += 2){
+    for( ; i < ctx->ts->cv5count && cv5[i].id == id; i += 2){
       if(cv5[i].group.edge.right == 51 && cv5[i].group.edge.down == 51){
         if(cv5[i].group.edge.left == cv5[i].group.edge.up){
-          TerrainTypes[id].edgeA = cv5[i].group.edge.left;
+          ctx->TerrainTypes[id].edgeA = cv5[i].group.edge.left;
         }else{
-          TerrainTypes[id].edgeA = cv5[i].group.edge.left;
-          TerrainTypes[id].edgeC[1] = cv5[i].group.edge.up;
+          ctx->TerrainTypes[id].edgeA = cv5[i].group.edge.left;
+          ctx->TerrainTypes[id].edgeC[1] = cv5[i].group.edge.up;
           typeMask &= (SEL_CLIFFS | SEL_STACK);
         }
       }
       if(cv5[i].group.edge.left == 51 && cv5[i].group.edge.up == 51){
         if(cv5[i].group.edge.right == cv5[i].group.edge.down){
           if(cv5[i].group.edge.right < EDGE_RSV_START) {
-            TerrainTypes[id].edgeB = cv5[i].group.edge.right;
+            ctx->TerrainTypes[id].edgeB = cv5[i].group.edge.right;
           }else if(cv5[i].group.edge.right == 55){
             // can't be simple
             typeMask &= ~SEL_SIMPLE;
@@ -1206,8 +2264,8 @@ void generateTypeTables(){
       }
       if(cv5[i].group.edge.up == 53 && cv5[i].group.edge.right == 50){
         if(cv5[i].group.edge.left != cv5[i].group.edge.down){
-          TerrainTypes[id].edgeC[2] = cv5[i].group.edge.left;
-          TerrainTypes[id].edgeC[1] = cv5[i].group.edge.down;
+          ctx->TerrainTypes[id].edgeC[2] = cv5[i].group.edge.left;
+          ctx->TerrainTypes[id].edgeC[1] = cv5[i].group.edge.down;
           typeMask &= (SEL_CLIFFS | SEL_STACK);
         }else{
           typeMask &= (SEL_NORMAL | SEL_SIMPLE);
@@ -1215,8 +2273,8 @@ void generateTypeTables(){
       }
       if(cv5[i].group.edge.left == 52 && cv5[i].group.edge.up == 54){
         if(cv5[i].group.edge.right != cv5[i].group.edge.down){
-          TerrainTypes[id].edgeC[3] = cv5[i].group.edge.right;
-          TerrainTypes[id].edgeC[0] = cv5[i].group.edge.down;
+          ctx->TerrainTypes[id].edgeC[3] = cv5[i].group.edge.right;
+          ctx->TerrainTypes[id].edgeC[0] = cv5[i].group.edge.down;
           typeMask &= (SEL_CLIFFS | SEL_STACK);
         }else{
           typeMask &= (SEL_NORMAL | SEL_SIMPLE);
@@ -1225,62 +2283,62 @@ void generateTypeTables(){
     }
     
     // preliminary type
-    TerrainTypes[id].patternType = typeMask;
+    ctx->TerrainTypes[id].patternType = typeMask;
     
     // back up one step
     i -= 2;
   }
   
   // pass 2: solidify types and get stacked cliff ids
-  for(i = 2; i < cv5count; i += 2){
+  for(i = 2; i < ctx->ts->cv5count; i += 2){
     id = cv5[i].id;
     if(id <= 1) continue;
     
-    if(TerrainTypes[id].ISOMType == 0) continue; // unknown type
-    if(TerrainTypes[id].groupType == GROUP_BASIC) continue; // basic types don't have anything left to do
+    if(ctx->TerrainTypes[id].ISOMType == 0) continue; // unknown type
+    if(ctx->TerrainTypes[id].groupType == GROUP_BASIC) continue; // basic types don't have anything left to do
     
-    typeMask = TerrainTypes[id].patternType;
+    typeMask = ctx->TerrainTypes[id].patternType;
     
-    doingStackCliff = cv5[i].group.edge.up < EDGE_RSV_START && !edgeMatchesType(cv5[i].group.edge.up, id);
+    doingStackCliff = cv5[i].group.edge.up < EDGE_RSV_START && !edgeMatchesType(ctx, cv5[i].group.edge.up, id);
     
-    for(j = i;  j < cv5count && cv5[j].id == id; j += 2){
+    for(j = i;  j < ctx->ts->cv5count && cv5[j].id == id; j += 2){
       if(doingStackCliff){
-        if(cv5[j].group.edge.up >= EDGE_RSV_START || edgeMatchesType(cv5[j].group.edge.up, id)){
+        if(cv5[j].group.edge.up >= EDGE_RSV_START || edgeMatchesType(ctx, cv5[j].group.edge.up, id)){
           break;
         }
       }else{
-        if(cv5[j].group.edge.up < EDGE_RSV_START && !edgeMatchesType(cv5[j].group.edge.up, cv5[j].id)){
+        if(cv5[j].group.edge.up < EDGE_RSV_START && !edgeMatchesType(ctx, cv5[j].group.edge.up, cv5[j].id)){
           break;
         }
       }
     }
     
     if(doingStackCliff){
-      if(j-i != 16) printf("Invalid stacked cliff range? cv5:%d, %d to %d (%d)\n", id, i, j, j-i);
-      TerrainTypes[id].patternType = PATTERN_TYPE_STACK;
-      TerrainTypes[id].groupType = GROUP_STACK;
+      if(j-i != 16) logWarn(LOG_TYPES, "Invalid stacked cliff range? cv5:%d, %d to %d (%d)\n", id, i, j, j-i);
+      ctx->TerrainTypes[id].patternType = PATTERN_TYPE_STACK;
+      ctx->TerrainTypes[id].groupType = GROUP_STACK;
       for(k = 0; k < MAX_TABLE_COUNT; k++){
-        if(TerrainTypes[k].ISOMType != 0){
-          if(TerrainTypes[k].edgeC[0] == cv5[i].group.edge.up || TerrainTypes[k].edgeC[1] == cv5[i].group.edge.up){
-            TerrainTypes[id].cliffUpper = k;
+        if(ctx->TerrainTypes[k].ISOMType != 0){
+          if(ctx->TerrainTypes[k].edgeC[0] == cv5[i].group.edge.up || ctx->TerrainTypes[k].edgeC[1] == cv5[i].group.edge.up){
+            ctx->TerrainTypes[id].cliffUpper = k;
             break;
           }
         }
       }
-      TerrainTypes[id].firstGroup = i;
-      TerrainTypes[id].lastGroup = j;
-      printf("cliff thing %d->%d, %d-%d\n", id, TerrainTypes[id].cliffUpper, i, j);
-    }else if(TerrainTypes[id].groupType == 0){ // don't assign a type if it already has one
-      TerrainTypes[id].groupType = GROUP_EDGE;
+      ctx->TerrainTypes[id].firstGroup = i;
+      ctx->TerrainTypes[id].lastGroup = j;
+      logDebug(LOG_TYPES, "cliff thing %d->%d, %d-%d\n", id, ctx->TerrainTypes[id].cliffUpper, i, j);
+    }else if(ctx->TerrainTypes[id].groupType == 0){ // don't assign a type if it already has one
+      ctx->TerrainTypes[id].groupType = GROUP_EDGE;
       if(typeMask & SEL_CLIFFS){
-        TerrainTypes[id].patternType = PATTERN_TYPE_CLIFFS;
+        ctx->TerrainTypes[id].patternType = PATTERN_TYPE_CLIFFS;
       }else if(typeMask & SEL_SIMPLE){
-        TerrainTypes[id].patternType = PATTERN_TYPE_SIMPLE;
+        ctx->TerrainTypes[id].patternType = PATTERN_TYPE_SIMPLE;
       }else if(typeMask & SEL_NORMAL){
-        TerrainTypes[id].patternType = PATTERN_TYPE_NORMAL;
+        ctx->TerrainTypes[id].patternType = PATTERN_TYPE_NORMAL;
       }else{
-        printf("Type doesn't exist? cv5:%d\n", id);
-        TerrainTypes[id].patternType = 0;
+        logWarn(LOG_TYPES, "Type doesn't exist? cv5:%d\n", id);
+        ctx->TerrainTypes[id].patternType = 0;
       }
     }
     
@@ -1289,17 +2347,18 @@ void generateTypeTables(){
   
   // debug stuff
   /*for(i = 0; i < MAX_TABLE_COUNT; i++){
-    if(TerrainTypes[i].ISOMType == 0) continue;
-    printf("%2d => 0x%2X -- %2d,%2d %2d,%2d,{%2d,%2d,%2d,%2d}\n", i, TerrainTypes[i].ISOMType, TerrainTypes[i].groupType, TerrainTypes[i].patternType, TerrainTypes[i].edgeA, TerrainTypes[i].edgeB, TerrainTypes[i].edgeC[0], TerrainTypes[i].edgeC[1], TerrainTypes[i].edgeC[2], TerrainTypes[i].edgeC[3]);
+    if(ctx->TerrainTypes[i].ISOMType == 0) continue;
+    logDebug(LOG_TYPES, "%2d => 0x%2X -- %2d,%2d %2d,%2d,{%2d,%2d,%2d,%2d}\n", i, ctx->TerrainTypes[i].ISOMType, ctx->TerrainTypes[i].groupType, ctx->TerrainTypes[i].patternType, ctx->TerrainTypes[i].edgeA, ctx->TerrainTypes[i].edgeB, ctx->TerrainTypes[i].edgeC[0], ctx->TerrainTypes[i].edgeC[1], ctx->TerrainTypes[i].edgeC[2], ctx->TerrainTypes[i].edgeC[3]);
   }*/
 }
 
 
 
 
-bool edgeMatches(u32 edge, u32 pattern, u32 id){
+// the cv5 edge value an ISOMPatterns edge code stands for with terrain type id
+u32 resolvePatternEdge(ISOMContext* ctx, u32 pattern, u32 id){
   // special cases for each pattern type
-  switch(TerrainTypes[id].patternType){
+  switch(ctx->TerrainTypes[id].patternType){
     case PATTERN_TYPE_SIMPLE:
       if(pattern == 55 || pattern == 56){
         pattern = MATCH_B;
@@ -1323,67 +2382,73 @@ bool edgeMatches(u32 edge, u32 pattern, u32 id){
   
   switch(pattern){
     case MATCH_A:
-      return edge == TerrainTypes[id].edgeA;
+      return ctx->TerrainTypes[id].edgeA;
     case MATCH_B:
-      return edge == TerrainTypes[id].edgeB;
+      return ctx->TerrainTypes[id].edgeB;
     case MATCH_C0:
-      return edge == TerrainTypes[id].edgeC[0];
+      return ctx->TerrainTypes[id].edgeC[0];
     case MATCH_C1:
-      return edge == TerrainTypes[id].edgeC[1];
+      return ctx->TerrainTypes[id].edgeC[1];
     case MATCH_C2:
-      return edge == TerrainTypes[id].edgeC[2];
+      return ctx->TerrainTypes[id].edgeC[2];
     case MATCH_C3:
-      return edge == TerrainTypes[id].edgeC[3];
+      return ctx->TerrainTypes[id].edgeC[3];
     default:
-      return edge == pattern;
+      return pattern;
+  }
+}
+
+// resolves every ISOMPatterns entry against every terrain type, so classification compares
+// packed edge bytes instead of interpreting MATCH_* codes for each window
+void compilePatterns(ISOMContext* ctx){
+  u32 id, i, k;
+  CompiledPattern* pat;
+  
+  for(id = 0; id < MAX_TABLE_COUNT; id++){
+    for(i = 0; i < ISOM_EDGE_COUNT; i++){
+      pat = PatternFor(id,i);
+      pat->edges = 0;
+      for(k = 0; k < 8; k++){
+        pat->edges |= (u64)(resolvePatternEdge(ctx, ISOMPatterns[i].edges[k], id) & 0xFF) << (k*8);
+      }
+      for(k = 0; k < 4; k++){
+        pat->tileTypes[k] = ISOMPatterns[i].tileTypes[ctx->TerrainTypes[id].patternType & 3][k];
+      }
+      pat->ISOMType = ctx->TerrainTypes[id].ISOMType + i;
+    }
   }
 }
 
-bool edgeMatchesType(u16 edge, u32 id){
+bool edgeMatchesType(ISOMContext* ctx, u16 edge, u32 id){
   if(edge == 0) return false;
   if(edge >= EDGE_RSV_START) return false;
-  if(TerrainTypes[id].edgeA == edge) return true;
-  if(TerrainTypes[id].edgeB == edge) return true;
+  if(ctx->TerrainTypes[id].edgeA == edge) return true;
+  if(ctx->TerrainTypes[id].edgeB == edge) return true;
   int i;
   for(i = 0; i < 4; i++){
-    if(TerrainTypes[id].edgeC[i] == edge) return true;
+    if(ctx->TerrainTypes[id].edgeC[i] == edge) return true;
   }
   return false;
 }
 
 
 
-u32 getCV5Index(u16 tile){
-  u16 id = tile >> 4;
-  tile &= 0xF;
-  if(id == 0 || id >= cv5count) return 0;
-  if(tile != 0 && cv5[id].tiles[tile] == 0) return 0;
-  if(cv5[id].id != CV5_DOODAD_ID) return id;
-  
-  u16 x = tile;
-  u16 y = 0;
-  if(x >= cv5[id].doodad.width) return 0;
-//  printf("doodad tile: %d.%d --> ", id, tile);
-  while(cv5[id-1].id == CV5_DOODAD_ID && cv5[id-1].doodad.doodadID == cv5[id].doodad.doodadID){
-    id--;
-    y++;
-  }
-//  printf("%d (%d,%d)\n", dddata[cv5[id].doodad.doodadID][y*cv5[id].doodad.width+x], x,y);
-  return dddata[cv5[id].doodad.doodadID][y*cv5[id].doodad.width+x];
+u32 getCV5Index(ISOMContext* ctx, u16 tile){
+  return ctx->ts->tileGroups[tile];
 }
 
-u32 getISOMFromBasicEdge(u16 id){
+u32 getISOMFromBasicEdge(ISOMContext* ctx, u16 id){
   if(id == 0 || id >= MAX_TABLE_COUNT || id >= EDGE_RSV_START) return 0;
   int i;
   for(i = 0; i < MAX_TABLE_COUNT; i++){
-    if(TerrainTypes[i].groupType == GROUP_BASIC && TerrainTypes[i].edgeA == id) return TerrainTypes[i].ISOMType;
+    if(ctx->TerrainTypes[i].groupType == GROUP_BASIC && ctx->TerrainTypes[i].edgeA == id) return ctx->TerrainTypes[i].ISOMType;
   }
   return 0;
 }
 
-bool isBasicGroup(u16 group){
-  if(group >= cv5count) return false;
-  return TerrainTypes[cv5[group].id].groupType == GROUP_BASIC;
+bool isBasicGroup(ISOMContext* ctx, u16 group){
+  if(group >= ctx->ts->cv5count) return false;
+  return (ctx->hotGroups[group].flags & GROUP_ANY) == GROUP_BASIC;
 }
 
 
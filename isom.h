@@ -1,17 +1,9 @@
 #ifndef H_ISOM
 #define H_ISOM
 #include "types.h"
+#include "terrain.h"
 
-
-bool initISOMData();
-bool generateISOMData();
-
-u16 getTileAt(u32 x, u32 y, RGBA* shading);
-
-bool isISOMPartialEdgeSimple(u32 baseType, u32 cmpType, u32 rectSide);
-
-// debug thing
-void printPatterns();
+#define MAX_TABLE_COUNT  48  // 38 is the highest normally used
 
 
 typedef union {
@@ -48,6 +40,143 @@ typedef struct {
   u16 ISOM;
 } CV5ISOM;
 
+// Terrain data
+typedef struct {
+  u8  groupType;   // basic, edge, stack
+  u8  patternType; // normal, simple, cliff, stackable cliff
+  u8  edgeA;       // plain or source CV5 edge type
+  u8  edgeB;       // final CV5 edge type
+  u8  edgeC[4];    // unique cliff IDs
+  u16 cliffUpper;  // stacked cliffs -- upper cliff CV5 id
+  u16 firstGroup;  // stacked cliffs -- first cv5 group (inclusive)
+  u16 lastGroup;   // stacked cliffs -- last cv5 group (exclusive)
+  u16 ISOMType;
+} TerrainType;
+
+// the parts of a cv5 group that ISOM classification reads, 8 bytes instead of 52
+typedef struct {
+  u16 id;       // cv5 id / TerrainTypes index
+  u8  edge[4];  // left, up, right, down
+  u8  flags;    // the id's GROUP_BASIC/EDGE/STACK type, plus HOT_* flags
+  u8  unused;
+} HotGroup;
+
+#define HOT_RIGHT_TILE   0x10  // odd group
+#define HOT_STACK_RANGE  0x20  // inside its stacked cliff's firstGroup-lastGroup range
+
+// memoized getRectISOMType result
+typedef struct {
+  u64 key;   // groups of the 4 left tiles in the window; 0 = empty slot
+  u32 type;
+} RectCacheEntry;
+
+#define RECT_CACHE_SIZE    4096  // must be a power of two
+#define RECT_CACHE_PROBES  8
+
+#define ISOM_TYPE_COUNT    2048  // ISOMTile.type is 11 bits
+#define ISOM_TYPE_WORDS    (ISOM_TYPE_COUNT/64)
+#define BASIC_TYPE_NONE    0xFF
+
+// valid partial edge ISOM types for each basic terrain, by rect side
+typedef struct {
+  u8  basicTerrain[ISOM_TYPE_COUNT];                    // ISOM type --> basic TerrainTypes index
+  u64 allOf[MAX_TABLE_COUNT][8][ISOM_TYPE_WORDS];       // every quadrant on the side is basic
+  u64 anyOf[MAX_TABLE_COUNT][4][ISOM_TYPE_WORDS];       // either quadrant on the side is basic
+} PartialEdgeSets;
+
+// an ISOMPatterns entry resolved against one terrain type
+typedef struct {
+  u64 edges;         // expected cv5 value of each rect edge, one byte per DIR_* index
+  u8  tileTypes[4];  // allowed group types of each quadrant for the terrain's pattern type
+  u16 ISOMType;      // terrain ISOMType + pattern index
+  u16 unused;
+} CompiledPattern;
+
+// sampleISOMData results
+typedef struct {
+  u32 checked;     // sampled positions that were ISOM cells
+  u32 mismatched;
+  double rate;     // estimated fraction of mismatched cells
+  double upper;    // 95% upper confidence bound on rate
+} ISOMSample;
+
+// bump allocator for buffers sized to the current map
+typedef struct {
+  u8* base;
+  u32 size;
+  u32 used;
+  u32 mark;   // end of the map buffers -- scratch allocations start here
+  s32 mapw;   // map size the buffers are laid out for
+  s32 maph;
+} ISOMArena;
+
+// All analysis state for a single map. Contexts share nothing, so separate
+// maps can be processed on separate threads with one context each.
+typedef struct {
+  const Tileset* ts;
+  ISOMArena arena;
+  
+  // chk data
+  u32 tileset;
+  s32 mapw;
+  s32 maph;
+  u16* maptiles;    // views of the loaded CHK's sections until something needs to write them,
+  ISOMRect* isom;   // then tileCopy and isomCopy
+  u16* tileCopy;
+  ISOMRect* isomCopy;
+  
+  // isom parsing data
+  u16* groups;
+  u16* edges;
+  TileDomain* tileDoms;
+  u64* tilePlanes;  // the map's TileDomain flags, one bit plane per flag
+  u32 planeWords;   // words per plane row
+  u16* isomTypes;   // isom split into separate type and dir values, refreshed by validateISOM
+  u8* isomDirs;
+  u8* basicRuns;    // length of the run of one basic terrain starting at each tile, up to 255
+  Domain* domains;  // grows to fit, kept between maps
+  u32 domainCount;
+  u32 domainCapacity;
+  u32 bands;  // row bands analyzed in parallel, 1 = serial
+  
+  TerrainType TerrainTypes[MAX_TABLE_COUNT];
+  PartialEdgeSets* partialEdges;
+  HotGroup* hotGroups;  // one per cv5 group
+  CompiledPattern* patterns;  // MAX_TABLE_COUNT*ISOM_EDGE_COUNT, from ISOMPatterns and TerrainTypes
+  u32 hotGroupCapacity;
+  
+  // classifier cache, partial edge sets and hot groups, valid for one era + cv5 hash
+  RectCacheEntry* rectCache;
+  u32 rectCacheEra;
+  u32 rectCacheHash;
+  u32 rectCacheHits;
+  u32 rectCacheLookups;
+} ISOMContext;
+
+
+ISOMContext* createISOMContext();
+void freeISOMContext(ISOMContext* ctx);
+
+bool loadTypeTableCache(const char* path);
+bool saveTypeTableCache(const char* path);
+
+bool initISOMData(ISOMContext* ctx);
+bool generateISOMData(ISOMContext* ctx);
+bool verifyISOMData(ISOMContext* ctx);
+bool sampleISOMData(ISOMContext* ctx, u32 samples, bool stratified, u32 seed, ISOMSample* result);
+void* allocISOMScratch(ISOMContext* ctx, u32 size);
+void resetISOMScratch(ISOMContext* ctx);
+void ownISOMBuffers(ISOMContext* ctx);
+bool updateISOMRect(ISOMContext* ctx, const u16* tiles, s32 left, s32 top, s32 width, s32 height);
+
+u16 getTileAt(ISOMContext* ctx, u32 x, u32 y, RGBA* shading);
+
+bool isISOMPartialEdgeSimple(ISOMContext* ctx, u32 baseType, u32 cmpType, u32 rectSide);
+
+// debug thing
+void printPatterns();
+
+
 
 
 // ISOM edge IDs
@@ -105,6 +234,22 @@ typedef struct {
 #define TILE_MISMATCHED       (TILE_MISMATCH_LEFT|TILE_MISMATCH_UP|TILE_MISMATCH_RIGHT|TILE_MISMATCH_DOWN)
 #define TILE_ISOM_GRID        (TILE_ISOM_GRID_0|TILE_ISOM_GRID_1|TILE_ISOM_GRID_2|TILE_ISOM_GRID_3)
 
+// Tile flag bit planes -- plane n holds flag (1 << n) for 64 tiles per word, map tiles only
+#define PLANE_COLUMN          0
+#define PLANE_BASIC_GROUP     1
+#define PLANE_DOODAD_TILE     2
+#define PLANE_BORDER_TYPE     3
+#define PLANE_HORZ_MISALIGN   4
+#define PLANE_VERT_MISALIGN   5
+#define PLANE_ID_IS_DOMAIN    6
+#define PLANE_INVALID_ISOM    7
+#define PLANE_MISMATCH_LEFT   8
+#define PLANE_MISMATCH_UP     9
+#define PLANE_MISMATCH_RIGHT  10
+#define PLANE_MISMATCH_DOWN   11
+#define PLANE_ISOM_GRID_0     12
+#define PLANE_COUNT           16
+
 
 // Domain flags
 #define DOM_SINGLE_GRID       1
@@ -0,0 +1,55 @@
+#include "log.h"
+#include <stdarg.h>
+
+u32 logLevel = LOG_DEFAULT_LEVEL;
+u32 logMask = LOG_ALL;
+
+// each thread collects its messages and writes them out in large blocks,
+// so workers don't fight over the console lock for every line
+THREAD_LOCAL char logBuffer[LOG_BUFFER_SIZE];
+THREAD_LOCAL u32 logBufferUsed = 0;
+
+
+void setLogLevel(u32 level){
+  if(level > LEVEL_TRACE) level = LEVEL_TRACE;
+  logLevel = level;
+}
+
+void setLogMask(u32 mask){
+  logMask = mask;
+}
+
+void logPrintf(const char* format, ...){
+  va_list args;
+  s32 len;
+  
+  va_start(args, format);
+  len = vsnprintf(logBuffer + logBufferUsed, LOG_BUFFER_SIZE - logBufferUsed, format, args);
+  va_end(args);
+  if(len < 0) return;
+  
+  if(logBufferUsed + len < LOG_BUFFER_SIZE){
+    logBufferUsed += len;
+    return;
+  }
+  
+  // didn't fit -- write out what was there and try again
+  logBuffer[logBufferUsed] = '\0';
+  logFlush();
+  va_start(args, format);
+  if(len < LOG_BUFFER_SIZE){
+    logBufferUsed = vsnprintf(logBuffer, LOG_BUFFER_SIZE, format, args);
+  }else{
+    // too long to buffer at all
+    vfprintf(stdout, format, args);
+  }
+  va_end(args);
+}
+
+// writes out the calling thread's buffered messages -- call before a thread exits
+void logFlush(){
+  if(logBufferUsed == 0) return;
+  fwrite(logBuffer, 1, logBufferUsed, stdout);
+  fflush(stdout);
+  logBufferUsed = 0;
+}
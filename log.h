@@ -0,0 +1,49 @@
+#ifndef H_LOG
+#define H_LOG
+#include "types.h"
+
+// message levels, most severe first
+#define LEVEL_ERROR    0
+#define LEVEL_WARN     1
+#define LEVEL_INFO     2
+#define LEVEL_DEBUG    3
+#define LEVEL_TRACE    4
+
+// anything above this level is compiled out entirely, arguments and all
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL  LEVEL_DEBUG
+#endif
+
+#define LOG_DEFAULT_LEVEL  LEVEL_INFO
+
+// message categories, can be masked at run time
+#define LOG_GENERAL    0x0001
+#define LOG_TILES      0x0002  // tile parsing and TILE/MTXM checks
+#define LOG_CELLS      0x0004  // per-cell ISOM validation and look-ups
+#define LOG_GRIDS      0x0008  // ISOM grid and domain search
+#define LOG_TYPES      0x0010  // terrain type table generation
+#define LOG_CHK        0x0020  // map section parsing
+#define LOG_FILES      0x0040  // disk and archive access
+#define LOG_ALL        0xFFFF
+
+#define LOG_BUFFER_SIZE  16384  // per-thread, flushed when full or by logFlush
+
+extern u32 logLevel;
+extern u32 logMask;
+
+#define LOG(level, cat, ...) do { \
+    if((level) <= LOG_COMPILE_LEVEL && (level) <= logLevel && (logMask & (cat))) logPrintf(__VA_ARGS__); \
+  } while(0)
+
+#define logError(cat, ...)  LOG(LEVEL_ERROR, cat, __VA_ARGS__)
+#define logWarn(cat, ...)   LOG(LEVEL_WARN,  cat, __VA_ARGS__)
+#define logInfo(cat, ...)   LOG(LEVEL_INFO,  cat, __VA_ARGS__)
+#define logDebug(cat, ...)  LOG(LEVEL_DEBUG, cat, __VA_ARGS__)
+#define logTrace(cat, ...)  LOG(LEVEL_TRACE, cat, __VA_ARGS__)
+
+void setLogLevel(u32 level);
+void setLogMask(u32 mask);
+void logPrintf(const char* format, ...);
+void logFlush();
+
+#endif
@@ -4,21 +4,83 @@
 #include "chk.h"
 #include "terrain.h"
 #include "isom.h"
+#include "log.h"
+#include "simd.h"
+#include <windows.h>
 
-// test mode buffers
-ISOMRect mapIsom[MAX_ISOM_WIDTH*MAX_ISOM_HEIGHT] = {0};
-ISOMRect genIsom[MAX_ISOM_WIDTH*MAX_ISOM_HEIGHT] = {0};
+// compareGen results
+#define TEST_PASS            0
+#define TEST_MISMATCH        1
+#define TEST_LOAD_FAILED     2
+#define TEST_SOURCE_INVALID  3
+#define TEST_GEN_FAILED      4
+#define TEST_NO_MEMORY       5
+#define TEST_PENDING         0xFF  // worker hasn't finished the map yet
 
-void testMaps();
-bool compareGen(const char* file, FILE* log);
+#define SAMPLE_SEED  0x2545F491  // fixed, so --sample triage is repeatable
+#define MAX_CACHE_MB 4095        // largest -m budget that still fits in a u32 of bytes
+#define MAX_JOBS_PER_CPU  4      // -j limit, since every worker has its own map-sized context
+#define UPDATE_TEST_SIZE  8      // -tu rect size in tiles -- a multiple of 4, so copies keep their ISOM grid
+
+const char* testResultText[] = {
+  "Generated ISOM matches.\n",
+  "Generatied ISOM does not match.\n",
+  "Could not load map.\n",
+  "Source ISOM is invalid.\n",
+  "ISOM generation failed.\n",
+  "Could not allocate memory :(\n"
+};
+
+// test worker pool -- each worker owns a range of map indexes and steals half of another worker's range when it runs out
+typedef struct {
+  volatile LONG64 range;  // next index in the low 32 bits, end index in the high 32 bits
+  HANDLE thread;
+  ISOMContext* ctx;
+} TestWorker;
+
+typedef struct {
+  char** paths;
+  volatile u8* results;
+  TestWorker* workers;
+  u32 workerCount;
+} TestPool;
+
+typedef struct {
+  TestPool* pool;
+  u32 id;
+} TestWorkerArg;
+
+#define RANGE(start,end)  ((LONG64)(((u64)(end) << 32) | (u32)(start)))
+#define RANGE_START(r)    ((u32)(r))
+#define RANGE_END(r)      ((u32)((u64)(r) >> 32))
+
+void testMaps(const char* dirpath, u32 jobs);
+DWORD WINAPI testWorker(LPVOID param);
+s32 popTestJob(TestWorker* worker);
+bool stealTestJobs(TestPool* pool, u32 thief);
+u32 compareGen(ISOMContext* ctx, const char* file);
+u32 compareUpdate(ISOMContext* ctx, const char* file);
 
 int main(int argc, char *argv[]){
   u32 openArg = 0;
   u32 saveArg = 0;
+  bool saveFailed = false;
+  bool patchArg = false;
+  bool atomicPatch = false;
+  u32 patch;
   bool testArg = false;
   bool testDir = false;
+  bool testUpdate = false;
   bool forceGen = false;
   bool forceWindow = false;
+  bool verifyArg = false;
+  u32 sampleArg = 0;
+  bool sampleStratified = true;
+  ISOMSample sample;
+  int exitCode = 0;
+  u32 jobs = 1;
+  u32 cacheArg = 0;
+  ISOMContext* ctx = NULL;
   
   // parse command line options
   if(argc > 1){
@@ -37,16 +99,67 @@ int main(int argc, char *argv[]){
             i++;
             saveArg = i;
             break;
+          case 'p':
+            patchArg = true;
+            atomicPatch = (argv[i][2] == 'a');
+            break;
           case 'g':
             forceGen = true;
             break;
           case 'w':
             forceWindow = true;
             break;
+          case 'c':
+            i++;
+            cacheArg = i;
+            break;
+          case 'm':
+            i++;
+            if(i < argc){
+              unsigned long megabytes = (argv[i][0] == '-') ? 0 : strtoul(argv[i], NULL, 10);
+              if(megabytes > MAX_CACHE_MB) megabytes = MAX_CACHE_MB;
+              setTilesetCacheBudget((u32)megabytes*1024*1024);
+            }
+            break;
+          case 'j':
+            i++;
+            if(i < argc){
+              unsigned long count;
+              SYSTEM_INFO info;
+              if(argv[i][0] == '-'){
+                printf("Invalid job count \"%s\"\n", argv[i]);
+                return 0;
+              }
+              count = strtoul(argv[i], NULL, 10);
+              GetSystemInfo(&info);
+              if(count == 0) count = info.dwNumberOfProcessors;
+              if(count > info.dwNumberOfProcessors*MAX_JOBS_PER_CPU) count = info.dwNumberOfProcessors*MAX_JOBS_PER_CPU;
+              jobs = count;
+            }
+            break;
+          case 'q':
+            setLogLevel(LEVEL_ERROR);
+            break;
+          case 'v':
+            setLogLevel(argv[i][2] == 'v' ? LEVEL_TRACE : LEVEL_DEBUG);
+            break;
           case 't':
-            if(argv[i][2] == 0 || argv[i][2] == 'd'){
+            if(argv[i][2] == 0 || argv[i][2] == 'd' || argv[i][2] == 'u'){
               testArg = true;
-              testDir = (argv[i][2] != 0);
+              testDir = (argv[i][2] == 'd');
+              testUpdate = (argv[i][2] == 'u');
+              break;
+            }
+          case '-':
+            if(strcmp(argv[i], "--verify") == 0){
+              verifyArg = true;
+              break;
+            }
+            if(strcmp(argv[i], "--sample") == 0 || strcmp(argv[i], "--sample-random") == 0){
+              sampleStratified = (argv[i][8] == 0);
+              verifyArg = true;
+              i++;
+              if(i < argc) sampleArg = atoi(argv[i]);
               break;
             }
           default:
@@ -57,18 +170,56 @@ int main(int argc, char *argv[]){
     }
   }
   
+  if(patchArg && openArg > 0){
+    // saving an archive rebuilds it with only the scenario, so archives are never saved over implicitly
+    if(strlen(argv[openArg]) < 4 || stricmp(argv[openArg] + strlen(argv[openArg]) - 4, ".chk") != 0){
+      printf("-p only works on .chk files, use -s to save \"%s\"\n", argv[openArg]);
+      return 0;
+    }
+    saveArg = openArg; // patching saves over the input
+  }
+  
+  ctx = createISOMContext();
+  if(ctx == NULL) return 0;
+  ctx->bands = jobs; // a single map splits its rows between the workers instead
+  
   initArchiveData();
   
+  if(cacheArg > 0 && cacheArg < argc){
+    loadTypeTableCache(argv[cacheArg]);
+  }
+  
   if(openArg > 0){
     setOpenFilename(argv[openArg]);
   }
   
+  if(verifyArg){
+    // exit code 0 = valid ISOM, 1 = invalid or missing, 2 = map couldn't be loaded
+    if(openArg == 0 || loadMap(ctx, argv[openArg]) == false){
+      puts("Could not load map.");
+      exitCode = 2;
+    }else if(sampleArg > 0 && sampleISOMData(ctx, sampleArg, sampleStratified, SAMPLE_SEED, &sample)
+             && sample.checked != 0 && sample.mismatched == 0){
+      // only maps with a sampled mismatch get the full check
+      printf("Source ISOM is probably valid (%d cells sampled, under %.2f%% mismatched at 95%% confidence).\n", sample.checked, sample.upper*100);
+    }else if(verifyISOMData(ctx)){
+      puts("Source ISOM is valid.");
+    }else{
+      puts("Source ISOM is invalid.");
+      exitCode = 1;
+    }
+    testArg = false;
+    saveArg = 0;
+  }
+  
   if(testArg){
     if(testDir){
-      testMaps(argv[openArg]);
+      testMaps(argv[openArg], jobs);
       setOpenFilename(argv[openArg]);
+    }else if(testUpdate){
+      fputs(testResultText[compareUpdate(ctx, argv[openArg])], stdout);
     }else{
-      compareGen(argv[openArg], stdout);
+      fputs(testResultText[compareGen(ctx, argv[openArg])], stdout);
     }
   }
   
@@ -78,28 +229,36 @@ int main(int argc, char *argv[]){
       setOpenFilename(""); // nothing to open either
     }else{
       if(testArg == false){
-        if(loadMap(argv[openArg]) == false){
+        if(loadMap(ctx, argv[openArg]) == false){
           puts("Could not load map.");
           setOpenFilename("");
-          saveArg = 1;
+          saveFailed = true;
         }else{
-          if(!forceGen && hasISOMData() && initISOMData()){
+          if(!forceGen && hasISOMData() && initISOMData(ctx)){
             puts("Source ISOM is valid.");
             // not an error
           }else{
             if(forceGen){
               clearMapISOM();
-              initISOMData();
+              initISOMData(ctx);
             }
-            if(generateISOMData() == false){
+            if(generateISOMData(ctx) == false){
               puts("ISOM generation failed.");
-              saveArg = 1;
+              saveFailed = true;
             }
           }
         }
       }
-      if(saveArg > 1){
-        if(writeMap(argv[saveArg])){
+      if(!saveFailed){
+        ownISOMBuffers(ctx); // saving can detach the CHK, and the window may still read the map afterwards
+        patch = patchArg ? patchMap(argv[saveArg], atomicPatch) : PATCH_NOT_POSSIBLE;
+        if(patch == PATCH_DONE){
+          puts("ISOM patched in place.");
+        }else if(patch == PATCH_UNCHANGED){
+          puts("Nothing changed, file left as is.");
+        }else if(patch == PATCH_FAILED){
+          puts("Could not patch map.");
+        }else if(writeMap(argv[saveArg], atomicPatch)){
           puts("File saved successfully!");
           setOpenFilename(argv[saveArg]);
         }
@@ -107,20 +266,26 @@ int main(int argc, char *argv[]){
     }
   }
   
-  if((!testArg && saveArg == 0) || forceWindow){
-    makeWindow();
+  if((!testArg && !verifyArg && saveArg == 0) || forceWindow){
+    makeWindow(ctx);
+  }
+  
+  if(cacheArg > 0 && cacheArg < argc){
+    saveTypeTableCache(argv[cacheArg]);
   }
   
   closeArchiveData();
-  unloadCHK();
-  unloadTileset();
+  freeCHKBuffers();
+  freeISOMContext(ctx);
+  clearTilesetCache();
+  logFlush();
   
-  return 0;
+  return exitCode;
 }
 
 
 // scans files in path and compares default ISOM data to generated ISOM data
-void testMaps(const char* dirpath){
+void testMaps(const char* dirpath, u32 jobs){
   FILE* log = fopen("isom test.log", "w");
   if(log == NULL){
     puts("Could not open log file.");
@@ -137,24 +302,123 @@ void testMaps(const char* dirpath){
   struct dirent* file;
   u32 count = 0;
   u32 pass = 0;
+  u32 capacity = 0;
+  u32 started;
   char path[520];
+  char** paths = NULL;
+  char** names = NULL;
+  char** grown;
   bool useSlash = (dirpath[strlen(dirpath)-1] != '\\');
+  u32 i;
   
+  // collect the file list first so results can be logged in directory order
   while ((file = readdir(dir)) != NULL){
     if(file->d_name[0] == '.') continue;
     
-    count++;
-    fprintf(log, "%-32s-- ", file->d_name);
+    if(count == capacity){
+      capacity = capacity ? capacity*2 : 256;
+      // the old arrays stay valid if either fails, so they can still be freed
+      grown = realloc(paths, capacity*sizeof(char*));
+      if(grown == NULL) break;
+      paths = grown;
+      grown = realloc(names, capacity*sizeof(char*));
+      if(grown == NULL) break;
+      names = grown;
+    }
     if(useSlash){
       sprintf(path, "%s\\%s", dirpath, file->d_name);
     }else{
       sprintf(path, "%s%s", dirpath, file->d_name);
     }
-    if(compareGen(path, log)) pass++;
+    paths[count] = strdup(path);
+    names[count] = strdup(file->d_name);
+    if(paths[count] == NULL || names[count] == NULL){
+      free(paths[count]);
+      free(names[count]);
+      break;
+    }
+    count++;
   }
   closedir(dir);
+  if(file != NULL){
+    // stopped early on an allocation failure
+    puts("Could not allocate memory :(");
+    for(i = 0; i < count; i++){
+      free(paths[i]);
+      free(names[i]);
+    }
+    free(paths);
+    free(names);
+    fclose(log);
+    return;
+  }
   
-  setOpenFilename(path);
+  u32 fileCount = count;
+  if(jobs < 1) jobs = 1;
+  if(jobs > count) jobs = count ? count : 1;
+  
+  TestPool pool = {paths, NULL, NULL, jobs};
+  TestWorkerArg* args = malloc(jobs*sizeof(TestWorkerArg));
+  pool.results = malloc(count ? count : 1);
+  pool.workers = calloc(jobs, sizeof(TestWorker));
+  if(args == NULL || pool.results == NULL || pool.workers == NULL){
+    puts("Could not allocate memory :(");
+    count = 0;
+    jobs = 0;
+  }else{
+    memset((u8*)pool.results, TEST_PENDING, count);
+  }
+  
+  // split the maps evenly and start the workers
+  for(i = 0; i < jobs; i++){
+    pool.workers[i].range = RANGE(count*i/jobs, count*(i+1)/jobs);
+    pool.workers[i].ctx = createISOMContext();
+    args[i].pool = &pool;
+    args[i].id = i;
+  }
+  started = 0;
+  for(i = 0; i < jobs; i++){
+    if(pool.workers[i].ctx != NULL){
+      pool.workers[i].thread = CreateThread(NULL, 0, testWorker, &args[i], 0, NULL);
+    }
+    if(pool.workers[i].thread != NULL){
+      started++;
+    }else{
+      // its range gets stolen by the other workers
+      printf("Could not start test worker %d\n", i);
+    }
+  }
+  if(started == 0 && count > 0){
+    memset((u8*)pool.results, TEST_NO_MEMORY, count);
+  }
+  
+  // write results in order as they complete
+  for(i = 0; i < count; i++){
+    while(pool.results[i] == TEST_PENDING) Sleep(10);
+    fprintf(log, "%-32s-- ", names[i]);
+    fputs(testResultText[pool.results[i]], log);
+    if(pool.results[i] == TEST_PASS) pass++;
+  }
+  
+  for(i = 0; i < jobs; i++){
+    if(pool.workers[i].thread != NULL){
+      WaitForSingleObject(pool.workers[i].thread, INFINITE);
+      CloseHandle(pool.workers[i].thread);
+    }
+    freeISOMContext(pool.workers[i].ctx);
+  }
+  
+  if(fileCount > 0) setOpenFilename(paths[fileCount-1]);
+  
+  for(i = 0; i < fileCount; i++){
+    free(paths[i]);
+    free(names[i]);
+  }
+  if(paths != NULL) free(paths);
+  if(names != NULL) free(names);
+  if(args != NULL) free(args);
+  if(pool.results != NULL) free((u8*)pool.results);
+  if(pool.workers != NULL) free(pool.workers);
   
   sprintf(path, "\n%d of %d passed.\n", pass, count);
   fputs(path, log);
@@ -162,33 +426,110 @@ void testMaps(const char* dirpath){
   fclose(log);
 }
 
+DWORD WINAPI testWorker(LPVOID param){
+  TestWorkerArg* arg = (TestWorkerArg*)param;
+  TestPool* pool = arg->pool;
+  TestWorker* worker = &pool->workers[arg->id];
+  s32 job;
+  
+  do {
+    while((job = popTestJob(worker)) >= 0){
+      pool->results[job] = compareGen(worker->ctx, pool->paths[job]);
+    }
+  } while(stealTestJobs(pool, arg->id));
+  
+  freeCHKBuffers();
+  logFlush();
+  return 0;
+}
+
+// takes the next index from the front of the worker's own range
+s32 popTestJob(TestWorker* worker){
+  LONG64 range, next;
+  do {
+    range = worker->range;
+    if(RANGE_START(range) >= RANGE_END(range)) return -1;
+    next = RANGE(RANGE_START(range)+1, RANGE_END(range));
+  } while(InterlockedCompareExchange64(&worker->range, next, range) != range);
+  return RANGE_START(range);
+}
+
+// moves the back half of the fullest worker's range into the thief's (empty) range
+bool stealTestJobs(TestPool* pool, u32 thief){
+  LONG64 range, next;
+  u32 i, victim, start, end, size, best;
+  
+  do {
+    best = 0;
+    for(i = 0; i < pool->workerCount; i++){
+      if(i == thief) continue;
+      range = pool->workers[i].range;
+      size = RANGE_END(range) - RANGE_START(range);
+      if(RANGE_START(range) < RANGE_END(range) && size > best){
+        best = size;
+        victim = i;
+      }
+    }
+    if(best == 0) return false;
+    
+    range = pool->workers[victim].range;
+    start = RANGE_START(range);
+    end = RANGE_END(range);
+    if(start >= end) continue; // victim finished in the meantime -- look again
+    size = (end - start + 1) / 2;
+    next = RANGE(start, end - size);
+    if(InterlockedCompareExchange64(&pool->workers[victim].range, next, range) == range){
+      InterlockedExchange64(&pool->workers[thief].range, RANGE(end - size, end));
+      return true;
+    }
+  } while(true);
+}
+
 // saves default ISOM data then re-generates it and compares the two
-bool compareGen(const char* file, FILE* log){
-  if(loadMap(file) == false){
-    fputs("Could not load map.\n", log);
-    return false;
+u32 compareGen(ISOMContext* ctx, const char* file){
+  ISOMRect* mapIsom;
+  ISOMRect* genIsom;
+  u64* mismatch;
+  
+  if(loadMap(ctx, file) == false){
+    return TEST_LOAD_FAILED;
   }
   
-  if(hasISOMData() == false || initISOMData() == false){
-    fputs("Source ISOM is invalid.\n", log);
-    return false;
+  if(hasISOMData() == false || initISOMData(ctx) == false){
+    return TEST_SOURCE_INVALID;
+  }
+  
+  u32 w,h,rects,diffs;
+  getMapDim(&w, &h);
+  rects = (w/2+1)*(h+1);
+  
+  resetISOMScratch(ctx);
+  mapIsom = allocISOMScratch(ctx, rects*sizeof(ISOMRect));
+  genIsom = allocISOMScratch(ctx, rects*sizeof(ISOMRect));
+  mismatch = allocISOMScratch(ctx, MISMATCH_WORDS(rects*4)*sizeof(u64));
+  if(mapIsom == NULL || genIsom == NULL || mismatch == NULL){
+    return TEST_NO_MEMORY;
   }
   
   getMapISOM(mapIsom);
   
   // force ISOM generation
   clearMapISOM();
-  initISOMData();
-  if(generateISOMData() == false){
-    fputs("ISOM generation failed.\n", log);
-    return false;
+  initISOMData(ctx);
+  if(generateISOMData(ctx) == false){
+    return TEST_GEN_FAILED;
   }
   
   getMapISOM(genIsom);
   
-  u32 w,h,isomSize;
-  getMapDim(&w, &h);
-  isomSize = (w/2+1)*(h+1)*sizeof(ISOMRect);
+  // one sweep over both grids finds every differing value -- only those rects need the checks below
+  diffs = compareISOMValues((const u16*)mapIsom, (const u16*)genIsom, rects*4, mismatch);
+  logDebug(LOG_GENERAL, "%d of %d ISOM values match\n", rects*4 - diffs, rects*4);
+  if(diffs == 0){
+    resetISOMScratch(ctx);
+    return TEST_PASS;
+  }
+  
   u32 x,y,i;
   bool match = true;
   u32 defaultTerrain = 0;
@@ -198,7 +539,7 @@ bool compareGen(const char* file, FILE* log){
       if(defaultTerrain == 0){
         defaultTerrain = mapIsom[i].left.type;
       }else if(defaultTerrain != mapIsom[i].left.type){
-        printf("inconsistent default terrain type ? l %d != %d\n", defaultTerrain, mapIsom[i].left.type);
+        logWarn(LOG_GENERAL, "inconsistent default terrain type ? l %d != %d\n", defaultTerrain, mapIsom[i].left.type);
         defaultTerrain = 0;
         break;
       }
@@ -207,7 +548,7 @@ bool compareGen(const char* file, FILE* log){
       if(defaultTerrain == 0){
         defaultTerrain = mapIsom[i].up.type;
       }else if(defaultTerrain != mapIsom[i].up.type){
-        printf("inconsistent default terrain type ? u %d != %d\n", defaultTerrain, mapIsom[i].up.type);
+        logWarn(LOG_GENERAL, "inconsistent default terrain type ? u %d != %d\n", defaultTerrain, mapIsom[i].up.type);
         defaultTerrain = 0;
         break;
       }
@@ -216,7 +557,7 @@ bool compareGen(const char* file, FILE* log){
       if(defaultTerrain == 0){
         defaultTerrain = mapIsom[i].down.type;
       }else if(defaultTerrain != mapIsom[i].down.type){
-        printf("inconsistent default terrain type ? d %d != %d\n", defaultTerrain, mapIsom[i].down.type);
+        logWarn(LOG_GENERAL, "inconsistent default terrain type ? d %d != %d\n", defaultTerrain, mapIsom[i].down.type);
         defaultTerrain = 0;
         break;
       }
@@ -226,7 +567,7 @@ bool compareGen(const char* file, FILE* log){
   i = 0;
   for(y = 0; match && y <= h; y++){
     for(x = 0; match && x <= w/2; x++){
-      if(memcmp(&(mapIsom[i]), &(genIsom[i]), sizeof(ISOMRect)) != 0){
+      if((mismatch[i/16] >> (i%16*4)) & 0xF){ // 4 values per rect
         // lazy checking by copying the unused entries directly from the source
         if(x == w/2){
           genIsom[i].right.type = mapIsom[i].right.type;
@@ -250,25 +591,78 @@ bool compareGen(const char* file, FILE* log){
         if(mapIsom[i].right.dir == 0 && mapIsom[i].right.type == defaultTerrain && genIsom[i].right.type != defaultTerrain) match = false;
         if(mapIsom[i].down.dir == 0 && mapIsom[i].down.type == defaultTerrain && genIsom[i].down.type != defaultTerrain) match = false;
         if(x == 0){
-          if(isISOMPartialEdgeSimple(genIsom[i].left.type, mapIsom[i].left.type, RIGHT) == false) match = false;
+          if(isISOMPartialEdgeSimple(ctx, genIsom[i].left.type, mapIsom[i].left.type, RIGHT) == false) match = false;
         }else if(x >= (w/2-1)){
-          if(isISOMPartialEdgeSimple(genIsom[i].right.type, mapIsom[i].right.type, LEFT) == false) match = false;
+          if(isISOMPartialEdgeSimple(ctx, genIsom[i].right.type, mapIsom[i].right.type, LEFT) == false) match = false;
         }
         if(y == 0){
-          if(isISOMPartialEdgeSimple(genIsom[i].up.type, mapIsom[i].up.type, DOWN) == false) match = false;
+          if(isISOMPartialEdgeSimple(ctx, genIsom[i].up.type, mapIsom[i].up.type, DOWN) == false) match = false;
         }else if(y >= (h-1)){
-          if(isISOMPartialEdgeSimple(genIsom[i].right.type, mapIsom[i].right.type, UP) == false) match = false;
+          if(isISOMPartialEdgeSimple(ctx, genIsom[i].right.type, mapIsom[i].right.type, UP) == false) match = false;
         }
       }
       i++;
     }
   }
   
-  if(match){
-    fputs("Generated ISOM matches.\n", log);
-  }else{
-    fputs("Generatied ISOM does not match.\n", log);
+  resetISOMScratch(ctx);
+  return match ? TEST_PASS : TEST_MISMATCH;
+}
+
+// copies a rect of the map's top left tiles to its middle with updateISOMRect, then checks the
+// result against regenerating the whole edited map
+u32 compareUpdate(ISOMContext* ctx, const char* file){
+  ISOMRect* updIsom;
+  ISOMRect* genIsom;
+  u64* mismatch;
+  u16 tiles[UPDATE_TEST_SIZE*UPDATE_TEST_SIZE];
+  u32 w,h,rects,diffs;
+  u32 x,y,left,top;
+  
+  if(loadMap(ctx, file) == false){
+    return TEST_LOAD_FAILED;
   }
+  getMapDim(&w, &h);
+  rects = (w/2+1)*(h+1);
+  
+  // start from generated ISOM, so cells outside the rect compare equal
+  clearMapISOM();
+  initISOMData(ctx);
+  if(generateISOMData(ctx) == false){
+    return TEST_GEN_FAILED;
+  }
+  
+  for(y = 0; y < UPDATE_TEST_SIZE; y++){
+    for(x = 0; x < UPDATE_TEST_SIZE; x++){
+      tiles[y*UPDATE_TEST_SIZE + x] = getMTXMTile(x, y);
+    }
+  }
+  left = (w/2) & ~3;
+  top = (h/2) & ~1;
+  if(updateISOMRect(ctx, tiles, left, top, UPDATE_TEST_SIZE, UPDATE_TEST_SIZE) == false){
+    return TEST_GEN_FAILED;
+  }
+  
+  resetISOMScratch(ctx);
+  updIsom = allocISOMScratch(ctx, rects*sizeof(ISOMRect));
+  genIsom = allocISOMScratch(ctx, rects*sizeof(ISOMRect));
+  mismatch = allocISOMScratch(ctx, MISMATCH_WORDS(rects*4)*sizeof(u64));
+  if(updIsom == NULL || genIsom == NULL || mismatch == NULL){
+    return TEST_NO_MEMORY;
+  }
+  getMapISOM(updIsom);
+  
+  // full pass over the edited map
+  clearMapISOM();
+  initISOMData(ctx);
+  if(generateISOMData(ctx) == false){
+    return TEST_GEN_FAILED;
+  }
+  getMapISOM(genIsom);
   
-  return match;
+  diffs = compareISOMValues((const u16*)updIsom, (const u16*)genIsom, rects*4, mismatch);
+  logDebug(LOG_GENERAL, "%d of %d ISOM values match after a %dx%d update at (%d,%d)\n", rects*4 - diffs, rects*4,
+           UPDATE_TEST_SIZE, UPDATE_TEST_SIZE, left, top);
+  resetISOMScratch(ctx);
+  return (diffs == 0) ? TEST_PASS : TEST_MISMATCH;
 }
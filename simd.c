@@ -0,0 +1,177 @@
+#include "simd.h"
+#ifdef ISOM_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+// ISOMTile bit layout: edited:1, dir:3, type:11, skipped:1 (lowest bit first)
+#define TILE_DIR_SHIFT   1
+#define TILE_DIR_MASK    0x7
+#define TILE_TYPE_SHIFT  4
+#define TILE_TYPE_MASK   0x7FF
+
+typedef u32 (*CompareKernel)(const u16* a, const u16* b, u32 words, u64* mismatch);
+typedef void (*SplitKernel)(const u16* values, u32 count, u16* types, u8* dirs);
+
+u32 compareWordsScalar(const u16* a, const u16* b, u32 words, u64* mismatch);
+void splitValuesScalar(const u16* values, u32 count, u16* types, u8* dirs);
+
+CompareKernel compareKernel = NULL;
+SplitKernel splitKernel = NULL;
+
+
+/* ----- Scalar ----- */
+
+u32 compareWordsScalar(const u16* a, const u16* b, u32 words, u64* mismatch){
+  u32 w, i;
+  u64 bits;
+  u32 diffs = 0;
+  for(w = 0; w < words; w++){
+    bits = 0;
+    for(i = 0; i < 64; i++){
+      if(a[w*64+i] != b[w*64+i]) bits |= (u64)1 << i;
+    }
+    mismatch[w] = bits;
+    diffs += __builtin_popcountll(bits);
+  }
+  return diffs;
+}
+
+void splitValuesScalar(const u16* values, u32 count, u16* types, u8* dirs){
+  u32 i;
+  for(i = 0; i < count; i++){
+    types[i] = (values[i] >> TILE_TYPE_SHIFT) & TILE_TYPE_MASK;
+    dirs[i] = (values[i] >> TILE_DIR_SHIFT) & TILE_DIR_MASK;
+  }
+}
+
+
+#ifdef ISOM_X86_KERNELS
+
+/* ----- SSE2 ----- */
+
+__attribute__((target("sse2")))
+u32 compareWordsSSE2(const u16* a, const u16* b, u32 words, u64* mismatch){
+  u32 w, i;
+  u64 bits;
+  u32 diffs = 0;
+  __m128i eq0, eq1;
+  for(w = 0; w < words; w++){
+    bits = 0;
+    for(i = 0; i < 64; i += 16){
+      eq0 = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)&a[w*64+i]), _mm_loadu_si128((const __m128i*)&b[w*64+i]));
+      eq1 = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)&a[w*64+i+8]), _mm_loadu_si128((const __m128i*)&b[w*64+i+8]));
+      bits |= (u64)(u16)~_mm_movemask_epi8(_mm_packs_epi16(eq0, eq1)) << i;
+    }
+    mismatch[w] = bits;
+    diffs += __builtin_popcountll(bits);
+  }
+  return diffs;
+}
+
+__attribute__((target("sse2")))
+void splitValuesSSE2(const u16* values, u32 count, u16* types, u8* dirs){
+  u32 i;
+  __m128i v0, v1;
+  const __m128i typeMask = _mm_set1_epi16(TILE_TYPE_MASK);
+  const __m128i dirMask = _mm_set1_epi16(TILE_DIR_MASK);
+  for(i = 0; i+16 <= count; i += 16){
+    v0 = _mm_loadu_si128((const __m128i*)&values[i]);
+    v1 = _mm_loadu_si128((const __m128i*)&values[i+8]);
+    _mm_storeu_si128((__m128i*)&types[i], _mm_and_si128(_mm_srli_epi16(v0, TILE_TYPE_SHIFT), typeMask));
+    _mm_storeu_si128((__m128i*)&types[i+8], _mm_and_si128(_mm_srli_epi16(v1, TILE_TYPE_SHIFT), typeMask));
+    _mm_storeu_si128((__m128i*)&dirs[i], _mm_packus_epi16(_mm_and_si128(_mm_srli_epi16(v0, TILE_DIR_SHIFT), dirMask),
+                                                          _mm_and_si128(_mm_srli_epi16(v1, TILE_DIR_SHIFT), dirMask)));
+  }
+  splitValuesScalar(values+i, count-i, types+i, dirs+i);
+}
+
+
+/* ----- AVX2 ----- */
+
+__attribute__((target("avx2")))
+u32 compareWordsAVX2(const u16* a, const u16* b, u32 words, u64* mismatch){
+  u32 w, i;
+  u64 bits;
+  u32 diffs = 0;
+  __m256i eq0, eq1;
+  for(w = 0; w < words; w++){
+    bits = 0;
+    for(i = 0; i < 64; i += 32){
+      eq0 = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)&a[w*64+i]), _mm256_loadu_si256((const __m256i*)&b[w*64+i]));
+      eq1 = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)&a[w*64+i+16]), _mm256_loadu_si256((const __m256i*)&b[w*64+i+16]));
+      // packs works within 128-bit lanes, so put the quarters back in order before taking the mask
+      eq0 = _mm256_permute4x64_epi64(_mm256_packs_epi16(eq0, eq1), 0xD8);
+      bits |= (u64)(u32)~_mm256_movemask_epi8(eq0) << i;
+    }
+    mismatch[w] = bits;
+    diffs += __builtin_popcountll(bits);
+  }
+  return diffs;
+}
+
+__attribute__((target("avx2")))
+void splitValuesAVX2(const u16* values, u32 count, u16* types, u8* dirs){
+  u32 i;
+  __m256i v0, v1, d;
+  const __m256i typeMask = _mm256_set1_epi16(TILE_TYPE_MASK);
+  const __m256i dirMask = _mm256_set1_epi16(TILE_DIR_MASK);
+  for(i = 0; i+32 <= count; i += 32){
+    v0 = _mm256_loadu_si256((const __m256i*)&values[i]);
+    v1 = _mm256_loadu_si256((const __m256i*)&values[i+16]);
+    _mm256_storeu_si256((__m256i*)&types[i], _mm256_and_si256(_mm256_srli_epi16(v0, TILE_TYPE_SHIFT), typeMask));
+    _mm256_storeu_si256((__m256i*)&types[i+16], _mm256_and_si256(_mm256_srli_epi16(v1, TILE_TYPE_SHIFT), typeMask));
+    d = _mm256_packus_epi16(_mm256_and_si256(_mm256_srli_epi16(v0, TILE_DIR_SHIFT), dirMask),
+                            _mm256_and_si256(_mm256_srli_epi16(v1, TILE_DIR_SHIFT), dirMask));
+    _mm256_storeu_si256((__m256i*)&dirs[i], _mm256_permute4x64_epi64(d, 0xD8));
+  }
+  splitValuesScalar(values+i, count-i, types+i, dirs+i);
+}
+
+#endif
+
+
+// picks the widest kernels the processor supports -- harmless to race, every thread picks the same
+void selectKernels(){
+  if(compareKernel != NULL && splitKernel != NULL) return;
+#ifdef ISOM_X86_KERNELS
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")){
+    splitKernel = splitValuesAVX2;
+    compareKernel = compareWordsAVX2;
+    return;
+  }
+  if(__builtin_cpu_supports("sse2")){
+    splitKernel = splitValuesSSE2;
+    compareKernel = compareWordsSSE2;
+    return;
+  }
+#endif
+  splitKernel = splitValuesScalar;
+  compareKernel = compareWordsScalar;
+}
+
+// sets bit i of mismatch wherever a[i] != b[i] and returns how many differ --
+// mismatch needs MISMATCH_WORDS(count) words
+u32 compareISOMValues(const u16* a, const u16* b, u32 count, u64* mismatch){
+  u32 words = count / 64;
+  u32 i;
+  u64 bits = 0;
+  u32 diffs;
+  
+  selectKernels();
+  diffs = compareKernel(a, b, words, mismatch);
+  if(count % 64 != 0){
+    for(i = words*64; i < count; i++){
+      if(a[i] != b[i]) bits |= (u64)1 << (i - words*64);
+    }
+    mismatch[words] = bits;
+    diffs += __builtin_popcountll(bits);
+  }
+  return diffs;
+}
+
+// splits every ISOMTile of the grid into separate type and dir values, in ISOMRect order
+void splitISOMPlanes(const ISOMRect* isom, u32 rects, u16* types, u8* dirs){
+  selectKernels();
+  splitKernel((const u16*)isom, rects*4, types, dirs);
+}
@@ -0,0 +1,16 @@
+#ifndef H_SIMD
+#define H_SIMD
+#include "types.h"
+#include "isom.h"
+
+// define ISOM_NO_SIMD to build only the scalar kernels
+#if !defined(ISOM_NO_SIMD) && defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define ISOM_X86_KERNELS
+#endif
+
+#define MISMATCH_WORDS(count)  (((count)+63)/64)
+
+u32 compareISOMValues(const u16* a, const u16* b, u32 count, u64* mismatch);
+void splitISOMPlanes(const ISOMRect* isom, u32 rects, u16* types, u8* dirs);
+
+#endif
@@ -1,99 +1,224 @@
 #include "terrain.h"
 #include "isom.h"
 #include "files.h"
+#include "log.h"
+#include <windows.h>
 
 const char tilesets[8][10] = {"badlands","platform","install","ashworld","jungle","desert","ice","twilight"};
 
+// resident tilesets, shared read-only between contexts and threads
+Tileset* tilesetCache[8] = {NULL};
+u32 tilesetCacheSize = 0;
+u32 tilesetCacheBudget = DEFAULT_TILESET_BUDGET;
+u32 tilesetCacheClock = 0;
+SRWLOCK tilesetCacheLock = SRWLOCK_INIT;
 
-CV5* cv5 = NULL;
-u32 cv5count = 0;
-VX4EX* vx4 = NULL;
-u32 vx4count = 0;
-VR4* vr4 = NULL;
-u32 vr4count = 0;
-RGBA wpe[256];
-u16 dddata[512][256];
-
-void unloadTileset(){
-  if(cv5 != NULL) free(cv5);
-  if(vx4 != NULL) free(vx4);
-  if(vr4 != NULL) free(vr4);
-  cv5 = NULL;
-  cv5count = 0;
-  vx4 = NULL;
-  vx4count = 0;
-  vr4 = NULL;
-  vr4count = 0;
+void trimTilesetCache();
+
+
+void unloadTileset(Tileset* ts){
+  if(ts == NULL) return;
+  if(ts->cv5 != NULL) free(ts->cv5);
+  if(ts->vx4 != NULL) free(ts->vx4);
+  if(ts->vr4 != NULL) free(ts->vr4);
+  if(ts->tileGroups != NULL) free(ts->tileGroups);
+  free(ts);
 }
 
-bool loadTileset(u32 id){
+Tileset* loadTileset(u32 id){
+  u32 i;
   u32 size;
   char filename[32];
+  Tileset* ts = calloc(1, sizeof(Tileset));
   
-  unloadTileset();
+  if(ts == NULL){
+    logError(LOG_GENERAL, "Could not allocate memory :(\n");
+    return NULL;
+  }
+  ts->era = id;
   
   do {
     sprintf(filename, "tileset\\%s.cv5", tilesets[id]);
-    cv5 = (CV5*)readFile(filename, &size, FILE_ARCHIVE);
-    if(cv5 == NULL) break;
-    cv5count = size / sizeof(CV5);
+    ts->cv5 = (CV5*)readFile(filename, &size, FILE_ARCHIVE);
+    if(ts->cv5 == NULL) break;
+    ts->cv5count = size / sizeof(CV5);
+    ts->cv5hash = hashData(ts->cv5, size);
     
     sprintf(filename, "tileset\\%s.vx4ex", tilesets[id]);
-    vx4 = (VX4EX*)readFile(filename, &size, FILE_ARCHIVE);
-    if(vx4 == NULL) break;
-    vx4count = size / sizeof(VX4EX);
+    ts->vx4 = (VX4EX*)readFile(filename, &size, FILE_ARCHIVE);
+    if(ts->vx4 == NULL) break;
+    ts->vx4count = size / sizeof(VX4EX);
     
     sprintf(filename, "tileset\\%s.vr4", tilesets[id]);
-    vr4 = (VR4*)readFile(filename, &size, FILE_ARCHIVE);
-    if(vr4 == NULL) break;
-    vr4count = size / sizeof(VR4);
+    ts->vr4 = (VR4*)readFile(filename, &size, FILE_ARCHIVE);
+    if(ts->vr4 == NULL) break;
+    ts->vr4count = size / sizeof(VR4);
+    
+    ts->memSize = sizeof(Tileset) + ts->cv5count*sizeof(CV5) + ts->vx4count*sizeof(VX4EX) + ts->vr4count*sizeof(VR4);
     
     sprintf(filename, "tileset\\%s.wpe", tilesets[id]);
-    if(readFileFixed(filename, wpe, sizeof(wpe), FILE_ARCHIVE) == false) break;
+    if(readFileFixed(filename, ts->wpe, sizeof(ts->wpe), FILE_ARCHIVE) == false) break;
     
     sprintf(filename, "tileset\\%s\\dddata.bin", tilesets[id]);
-    if(readFileFixed(filename, dddata, sizeof(dddata), FILE_ARCHIVE) == false) break;
+    if(readFileFixed(filename, ts->dddata, sizeof(ts->dddata), FILE_ARCHIVE) == false) break;
     
-    return true;
+    // resolve every possible MTXM value up front so maps convert with a single look-up per tile
+    ts->tileGroups = malloc(65536*sizeof(u16));
+    if(ts->tileGroups == NULL){
+      logError(LOG_GENERAL, "Could not allocate memory :(\n");
+      break;
+    }
+    for(i = 0; i < 65536; i++){
+      ts->tileGroups[i] = resolveTileGroup(ts, i);
+    }
+    ts->memSize += 65536*sizeof(u16);
+    
+    return ts;
   } while(false);
   
-  puts("Error loading tileset.");
-  unloadTileset();
-  return false;
+  logError(LOG_FILES, "Error loading tileset.\n");
+  unloadTileset(ts);
+  return NULL;
+}
+
+// returns a shared tileset, loading it if it isn't resident -- must be released with releaseTileset
+const Tileset* acquireTileset(u32 id){
+  Tileset* ts;
+  
+  id &= 7;
+  AcquireSRWLockExclusive(&tilesetCacheLock);
+  ts = tilesetCache[id];
+  if(ts == NULL){
+    ts = loadTileset(id);
+    if(ts != NULL){
+      tilesetCache[id] = ts;
+      tilesetCacheSize += ts->memSize;
+    }
+  }
+  if(ts != NULL){
+    ts->refs++;
+    ts->lastUse = ++tilesetCacheClock;
+    trimTilesetCache();
+  }
+  ReleaseSRWLockExclusive(&tilesetCacheLock);
+  
+  return ts;
+}
+
+void releaseTileset(const Tileset* ts){
+  if(ts == NULL) return;
+  AcquireSRWLockExclusive(&tilesetCacheLock);
+  if(ts->refs > 0) ((Tileset*)ts)->refs--;
+  trimTilesetCache();
+  ReleaseSRWLockExclusive(&tilesetCacheLock);
+}
+
+void setTilesetCacheBudget(u32 bytes){
+  AcquireSRWLockExclusive(&tilesetCacheLock);
+  tilesetCacheBudget = bytes;
+  trimTilesetCache();
+  ReleaseSRWLockExclusive(&tilesetCacheLock);
+}
+
+// frees every tileset, referenced or not -- only for shutdown
+void clearTilesetCache(){
+  u32 i;
+  AcquireSRWLockExclusive(&tilesetCacheLock);
+  for(i = 0; i < 8; i++){
+    unloadTileset(tilesetCache[i]);
+    tilesetCache[i] = NULL;
+  }
+  tilesetCacheSize = 0;
+  ReleaseSRWLockExclusive(&tilesetCacheLock);
+}
+
+// evicts least recently used tilesets that have no handles until the cache fits the budget
+// (caller holds tilesetCacheLock)
+void trimTilesetCache(){
+  u32 i;
+  s32 lru;
+  
+  while(tilesetCacheSize > tilesetCacheBudget){
+    lru = -1;
+    for(i = 0; i < 8; i++){
+      if(tilesetCache[i] == NULL || tilesetCache[i]->refs != 0) continue;
+      if(lru == -1 || tilesetCache[i]->lastUse < tilesetCache[lru]->lastUse) lru = i;
+    }
+    if(lru == -1) return; // everything left is in use
+    
+    tilesetCacheSize -= tilesetCache[lru]->memSize;
+    unloadTileset(tilesetCache[lru]);
+    tilesetCache[lru] = NULL;
+  }
+}
+
+
+// gets the cv5 group a tile actually uses
+u32 resolveTileGroup(const Tileset* ts, u16 tile){
+  const CV5* cv5 = ts->cv5;
+  u16 id = tile >> 4;
+  u32 group;
+  tile &= 0xF;
+  if(id == 0 || id >= ts->cv5count) return 0;
+  if(tile != 0 && cv5[id].tiles[tile] == 0) return 0;
+  if(cv5[id].id != CV5_DOODAD_ID) return id;
+  
+  u16 x = tile;
+  u16 y = 0;
+  if(x >= cv5[id].doodad.width) return 0;
+  while(id > 1 && cv5[id-1].id == CV5_DOODAD_ID && cv5[id-1].doodad.doodadID == cv5[id].doodad.doodadID){
+    id--;
+    y++;
+  }
+  if(cv5[id].doodad.doodadID >= 512 || y*cv5[id].doodad.width+x >= 256) return 0;
+  group = ts->dddata[cv5[id].doodad.doodadID][y*cv5[id].doodad.width+x];
+  if(group >= ts->cv5count) return 0;
+  return group;
+}
+
+// 32-bit FNV-1a
+u32 hashData(const void* data, u32 size){
+  const u8* bytes = (const u8*)data;
+  u32 hash = 2166136261UL;
+  u32 i;
+  for(i = 0; i < size; i++){
+    hash = (hash ^ bytes[i]) * 16777619UL;
+  }
+  return hash;
 }
 
-void copyPal(RGBA* pal){
+void copyPal(const Tileset* ts, RGBA* pal){
   u32 i;
   for(i = 0; i < 256; i++){
-    pal[i].b = wpe[i].r;
-    pal[i].g = wpe[i].g;
-    pal[i].r = wpe[i].b;
+    pal[i].b = ts->wpe[i].r;
+    pal[i].g = ts->wpe[i].g;
+    pal[i].r = ts->wpe[i].b;
     pal[i].a = 0;
   }
 }
 
-void drawTile(u8* buf, s32 bufWidth, s32 bufHeight, s32 dstX, s32 dstY, u32 tileID, RGBA shading){
+void drawTile(const Tileset* ts, u8* buf, s32 bufWidth, s32 bufHeight, s32 dstX, s32 dstY, u32 tileID, RGBA shading){
   u32 group = tileID >> 4;
   u32 tile = tileID & 0xF;
   bool flip;
   u32 i,x,y;
   
-  if(group >= cv5count) group = 0;
-  tileID = cv5[group].tiles[tile];
-  if(tileID >= vx4count) tileID = 0;
+  if(group >= ts->cv5count) group = 0;
+  tileID = ts->cv5[group].tiles[tile];
+  if(tileID >= ts->vx4count) tileID = 0;
   
   for(i = 0; i < 16; i++){
     x = (i & 3) * 8;
     y = (i >> 2) * 8;
-    flip = vx4[tileID].tiles[i] & 1;
-    tile = vx4[tileID].tiles[i] >> 1;
-    drawMiniTile(buf, bufWidth, bufHeight, dstX + x, dstY + y, tile, flip, shading);
+    flip = ts->vx4[tileID].tiles[i] & 1;
+    tile = ts->vx4[tileID].tiles[i] >> 1;
+    drawMiniTile(ts, buf, bufWidth, bufHeight, dstX + x, dstY + y, tile, flip, shading);
   }
 }
 
-void drawMiniTile(u8* buf, s32 bufWidth, s32 bufHeight, s32 dstX, s32 dstY, u32 tileID, bool flip, RGBA shading){
+void drawMiniTile(const Tileset* ts, u8* buf, s32 bufWidth, s32 bufHeight, s32 dstX, s32 dstY, u32 tileID, bool flip, RGBA shading){
   if(dstX < -7 || dstY < -7 || dstX >= bufWidth/3 || dstY >= bufHeight) return;
-  if(tileID >= vr4count) tileID = 0;
+  if(tileID >= ts->vr4count) tileID = 0;
   
   s32 xmin = (dstX < 0) ? -dstX : 0;
   s32 ymin = (dstY < 0) ? -dstY : 0;
@@ -102,15 +227,16 @@ void drawMiniTile(u8* buf, s32 bufWidth, s32 bufHeight, s32 dstX, s32 dstY, u32
   s32 x,y;
   s32 bufoffs;
   u32 pal;
+  const RGBA* wpe = ts->wpe;
   
   for(y = ymin; y < ymax; y++){
     //bufoffs = (bufHeight - dstY - y - 1) * bufWidth + dstX;
     bufoffs = (bufHeight - dstY - y - 1) * bufWidth + dstX*3;
     for(x = xmin; x < xmax; x++){
       if(flip){
-        pal = vr4[tileID].bmp[y*8 + 7 - x];
+        pal = ts->vr4[tileID].bmp[y*8 + 7 - x];
       }else{
-        pal = vr4[tileID].bmp[y*8 + x];
+        pal = ts->vr4[tileID].bmp[y*8 + x];
       }
       if(shading.a == 0){
         buf[bufoffs + x*3 +0] = wpe[pal].b;
@@ -125,10 +251,12 @@ void drawMiniTile(u8* buf, s32 bufWidth, s32 bufHeight, s32 dstX, s32 dstY, u32
   }
 }
 
-void drawMinimap(u8* buf, s32 bufw, s32 bufh, u32 width, u32 height, u32 scale){
+void drawMinimap(const Tileset* ts, const u16* tiles, u8* buf, s32 bufw, s32 bufh, u32 width, u32 height, u32 scale){
   u32 x,y;
   u32 bufoffs;
   u32 tile,group;
+  const VX4EX* vx4 = ts->vx4;
+  const VR4* vr4 = ts->vr4;
   for(y = 0; y < height; y++){
     switch(scale){
       case MINIMAP_64:
@@ -144,15 +272,15 @@ void drawMinimap(u8* buf, s32 bufw, s32 bufh, u32 width, u32 height, u32 scale){
     }
     for(x = 0; x < width; x++){
       // MTXM tile
-      tile = getTileAt(x, y, NULL);
+      tile = tiles[y*width + x];
       
       // CV5 tile
       group = tile >> 4;
       tile = tile & 0xF;
-      if(group >= cv5count) group = 0;
+      if(group >= ts->cv5count) group = 0;
       
       // VX4 tile
-      tile = cv5[group].tiles[tile];
+      tile = ts->cv5[group].tiles[tile];
       
       switch(scale){
         case MINIMAP_64:
@@ -36,14 +36,39 @@ typedef struct {
   u8 bmp[64];
 } VR4;
 
+// all data for a single tileset
+typedef struct {
+  u32 era;
+  u32 refs;       // handles given out by acquireTileset
+  u32 lastUse;    // cache clock at last acquire
+  u32 memSize;    // bytes used, for the cache budget
+  CV5* cv5;
+  u32 cv5count;
+  u32 cv5hash;    // identifies the cv5 contents for cached look-up tables
+  VX4EX* vx4;
+  u32 vx4count;
+  VR4* vr4;
+  u32 vr4count;
+  RGBA wpe[256];
+  u16 dddata[512][256];
+  u16* tileGroups;  // MTXM tile value --> effective cv5 group (doodads resolved through dddata), 0 if invalid
+} Tileset;
+
 
-void unloadTileset();
-bool loadTileset(u32 tileset);
+void unloadTileset(Tileset* ts);
+Tileset* loadTileset(u32 tileset);
 
-void copyPal(RGBA* pal);
-void drawTile(u8* buf, s32 bufWidth, s32 bufHeight, s32 dstX, s32 dstY, u32 tileID, RGBA shading);
-void drawMiniTile(u8* buf, s32 bufWidth, s32 bufHeight, s32 dstX, s32 dstY, u32 tileID, bool flip, RGBA shading);
-void drawMinimap(u8* buf, s32 bufw, s32 bufh, u32 width, u32 height, u32 scale);
+const Tileset* acquireTileset(u32 tileset);
+void releaseTileset(const Tileset* ts);
+void setTilesetCacheBudget(u32 bytes);
+void clearTilesetCache();
+u32 hashData(const void* data, u32 size);
+u32 resolveTileGroup(const Tileset* ts, u16 tile);
+
+void copyPal(const Tileset* ts, RGBA* pal);
+void drawTile(const Tileset* ts, u8* buf, s32 bufWidth, s32 bufHeight, s32 dstX, s32 dstY, u32 tileID, RGBA shading);
+void drawMiniTile(const Tileset* ts, u8* buf, s32 bufWidth, s32 bufHeight, s32 dstX, s32 dstY, u32 tileID, bool flip, RGBA shading);
+void drawMinimap(const Tileset* ts, const u16* tiles, u8* buf, s32 bufw, s32 bufh, u32 width, u32 height, u32 scale);
 
 
 // Minimap scale sizes
@@ -53,4 +78,6 @@ void drawMinimap(u8* buf, s32 bufw, s32 bufh, u32 width, u32 height, u32 scale);
 
 #define CV5_DOODAD_ID 1
 
+#define DEFAULT_TILESET_BUDGET  (64*1024*1024)
+
 #endif
@@ -14,6 +14,9 @@ typedef uint64_t u64;
 typedef  int64_t s64;
 typedef enum{false, true} bool;
 
+// module state that each worker thread gets its own copy of
+#define THREAD_LOCAL __thread
+
 typedef struct {
   s16 left;
   s16 up;